@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+#
+# python-v4l2capture
+#
+# This file measures the capture rate and the dequeue latency and jitter
+# of a video device, optionally with the read path pinned to CPUs, run
+# with SCHED_FIFO and with locked buffers (see Video_device.set_realtime).
+#
+# I, the copyright holder of this file, hereby release it into the
+# public domain. This applies worldwide. In case this is not legally
+# possible: I grant anyone the right to use this work for any
+# purpose, without any conditions, unless such conditions are
+# required by law.
+
+import argparse
+import select
+import time
+import v4l2capture
+
+parser = argparse.ArgumentParser()
+parser.add_argument("device", nargs="?", default="/dev/video0")
+parser.add_argument("--frames", type=int, default=300)
+parser.add_argument("--size", default="640x480")
+parser.add_argument("--fourcc", default="YUYV")
+parser.add_argument("--cpus", help="comma separated CPU numbers")
+parser.add_argument("--priority", type=int, default=0,
+                    help="SCHED_FIFO priority")
+parser.add_argument("--lock", action="store_true", help="lock buffers")
+args = parser.parse_args()
+
+video = v4l2capture.Video_device(args.device)
+size_x, size_y = [int(x) for x in args.size.split("x")]
+size_x, size_y = video.set_format(size_x, size_y, fourcc=args.fourcc)
+video.create_buffers(8)
+video.set_realtime(
+    cpus=[int(x) for x in args.cpus.split(",")] if args.cpus else None,
+    priority=args.priority, lock_memory=args.lock)
+video.queue_all_buffers()
+video.start()
+
+# Let the device settle before measuring.
+for i in range(10):
+    select.select((video,), (), ())
+    video.read_and_queue()
+video.get_latency(reset=True)
+
+start = time.monotonic()
+for i in range(args.frames):
+    select.select((video,), (), ())
+    video.read_and_queue()
+elapsed = time.monotonic() - start
+video.close()
+
+latency = video.get_latency()
+print("%s: %d x %d %s, %d frames in %.2f s (%.1f fps)" % (
+    args.device, size_x, size_y, args.fourcc, args.frames, elapsed,
+    args.frames / elapsed))
+print("dequeue latency: mean %.3f ms, min %.3f ms, max %.3f ms, "
+      "jitter %.3f ms (%d frames)" % (
+          latency["mean"] * 1000, latency["min"] * 1000,
+          latency["max"] * 1000, latency["jitter"] * 1000,
+          latency["count"]))
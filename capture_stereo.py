@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+#
+# python-v4l2capture
+#
+# This file captures matched frame sets from two or more cameras (for
+# example a stereo pair) with Frame_synchronizer and reports how far
+# apart the frames of each set were taken.
+#
+# I, the copyright holder of this file, hereby release it into the
+# public domain. This applies worldwide. In case this is not legally
+# possible: I grant anyone the right to use this work for any
+# purpose, without any conditions, unless such conditions are
+# required by law.
+
+import argparse
+import select
+import v4l2capture
+
+parser = argparse.ArgumentParser()
+parser.add_argument("devices", nargs="*",
+                    default=["/dev/video0", "/dev/video2"])
+parser.add_argument("--sets", type=int, default=100)
+parser.add_argument("--size", default="640x480")
+parser.add_argument("--tolerance", type=float, default=0.005,
+                    help="seconds")
+args = parser.parse_args()
+
+size_x, size_y = (int(x) for x in args.size.split("x"))
+videos = [v4l2capture.Video_device(path) for path in args.devices]
+
+for video in videos:
+    video.set_format(size_x, size_y)
+    video.create_buffers(6)
+    video.queue_all_buffers()
+
+for video in videos:
+    video.start()
+
+# Hold up to two frames per camera while waiting for the others. Use
+# CLOCK_REALTIME to compare the timestamps with other machines.
+synchronizer = v4l2capture.Frame_synchronizer(
+    videos, tolerance=args.tolerance, window=2,
+    clock=v4l2capture.CLOCK_REALTIME)
+
+sets = 0
+while sets < args.sets:
+    select.select(videos, (), ())
+
+    # Frames the synchronizer already holds don't make a device readable
+    # again, so take every complete set before waiting.
+    while sets < args.sets:
+        result = synchronizer.read()
+        if result is None:
+            break
+        frames, timestamps, sequences = result
+        sets += 1
+        print("%.6f spread %.2f ms sequences %s" % (
+            timestamps[0], (max(timestamps) - min(timestamps)) * 1000,
+            " ".join(str(x) for x in sequences)))
+
+counters = synchronizer.get_counters()
+print("%d sets, dropped per camera: %s" % (
+    counters["matched"], ", ".join(str(x) for x in counters["dropped"])))
+
+synchronizer.close()
+for video in videos:
+    video.close()
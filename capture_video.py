@@ -1,4 +1,4 @@
-#!/usr/bin/python
+#!/usr/bin/env python3
 #
 # python-v4l2capture
 #
@@ -13,8 +13,7 @@
 # purpose, without any conditions, unless such conditions are
 # required by law.
 
-import Image
-import select
+from PIL import Image
 import v4l2capture
 import time
 
@@ -40,12 +39,12 @@ video.start()
 stop_time = time.time() + 10.0
 with open('video.mjpg', 'wb') as f:
     while stop_time >= time.time():
-        # Wait for the device to fill the buffer.
-        select.select((video,), (), ())
-
-        # The rest is easy :-)
-        image_data = video.read_and_queue()
-        f.write(image_data)
+        # Wait for the device to fill the buffer, with the GIL released,
+        # and read it. Frames dropped by set_delivery_policy or
+        # set_motion_detection are handled without waking up this loop.
+        image_data = video.wait_and_read(timeout=1.0, queue=True)
+        if image_data is not None:
+            f.write(image_data)
     
 video.close()
-print "Saved video.mjpg (Size: " + str(size_x) + " x " + str(size_y) + ")"
+print("Saved video.mjpg (Size: " + str(size_x) + " x " + str(size_y) + ")")
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+#
+# python-v4l2capture
+#
+# This file is an example on how to encode video with a memory-to-memory
+# codec device. Captured buffers are passed to the encoder by DMABUF, so
+# the raw frames are never copied. The vicodec driver ('modprobe vicodec')
+# can be used in place of a hardware encoder.
+#
+# I, the copyright holder of this file, hereby release it into the
+# public domain. This applies worldwide. In case this is not legally
+# possible: I grant anyone the right to use this work for any
+# purpose, without any conditions, unless such conditions are
+# required by law.
+
+import select
+import sys
+import time
+import v4l2capture
+
+if len(sys.argv) != 3:
+    sys.exit("Usage: encode_video.py CAMERA_DEVICE ENCODER_DEVICE")
+
+# Open the camera and the encoder.
+video = v4l2capture.Video_device(sys.argv[1])
+encoder = v4l2capture.M2M_device(sys.argv[2])
+
+# The encoder reads the camera buffers directly, so both must agree on
+# the raw format.
+size_x, size_y = video.set_format(640, 480, fourcc='YUYV')
+encoder.set_format(size_x, size_y, 'YUYV', 'FWHT')
+
+video.create_buffers(8)
+video.queue_all_buffers()
+encoder.create_buffers(4, 4, dmabuf=1)
+encoder.queue_all_buffers()
+
+video.start()
+encoder.start()
+
+stop_time = time.time() + 10.0
+with open('video.fwht', 'wb') as f:
+    while stop_time >= time.time():
+        readable, _, _ = select.select((video, encoder), (), ())
+
+        if video in readable:
+            try:
+                encoder.queue_from(video)
+            except IOError:
+                # All encoder input buffers are busy; try again once
+                # encoded data has been read.
+                pass
+
+        if encoder in readable:
+            data, timestamp = encoder.read_and_queue()
+            f.write(data)
+
+encoder.close()
+video.close()
+print("Saved video.fwht (Size: " + str(size_x) + " x " + str(size_y) + ")")
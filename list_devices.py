@@ -1,4 +1,4 @@
-#!/usr/bin/python
+#!/usr/bin/env python3
 #
 # python-v4l2capture
 #
@@ -10,19 +10,21 @@
 # purpose, without any conditions, unless such conditions are
 # required by law.
 
-import os
 import v4l2capture
-file_names = [x for x in os.listdir("/dev") if x.startswith("video")]
-file_names.sort()
-for file_name in file_names:
-    path = "/dev/" + file_name
-    print path
-    try:
-        video = v4l2capture.Video_device(path)
-        driver, card, bus_info, capabilities = video.get_info()
-        print "    driver:       %s\n    card:         %s" \
-            "\n    bus info:     %s\n    capabilities: %s" % (
-                driver, card, bus_info, ", ".join(capabilities))
-        video.close()
-    except IOError, e:
-        print "    " + str(e)
+
+# Probe all video nodes in parallel. A node that doesn't answer within a
+# second is reported as timed out instead of holding up the others.
+for device in v4l2capture.discover(timeout=1.0):
+    print(device["path"])
+    if device["error"]:
+        print("    " + device["error"])
+        continue
+    print("    driver:       %s\n    card:         %s"
+        "\n    bus info:     %s\n    capabilities: %s" % (
+            device["driver"], device["card"], device["bus_info"],
+            ", ".join(sorted(c.decode() for c in device["capabilities"]))))
+    for buffer_type, formats in sorted(device["formats"].items()):
+        print("    %-13s %s" % (buffer_type + ":", ", ".join(
+            "%s (%s)" % (fourcc.decode(errors="backslashreplace"),
+                         description)
+            for fourcc, description in formats)))
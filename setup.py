@@ -1,4 +1,4 @@
-#!/usr/bin/python
+#!/usr/bin/env python3
 #
 # python-v4l2capture
 #
@@ -10,7 +10,7 @@
 # purpose, without any conditions, unless such conditions are
 # required by law.
 
-from distutils.core import Extension, setup
+from setuptools import Extension, setup
 setup(
     name = "v4l2capture",
     version = "1.5",
@@ -23,6 +23,9 @@ setup(
     license = "Public Domain",
     classifiers = [
         "License :: Public Domain",
-        "Programming Language :: C"],
+        "Programming Language :: C",
+        "Programming Language :: Python :: 3",
+        "Programming Language :: Python :: Free Threading :: 2 - Beta"],
+    python_requires = ">=3.9",
     ext_modules = [
-        Extension("v4l2capture", ["v4l2capture.c"], libraries = ["v4l2"])])
+        Extension("v4l2capture", ["v4l2capture.c"], libraries = ["v4l2", "rt"])])
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# python-v4l2capture
+#
+# This file is an example on how to share frames between processes with
+# a Frame_ring. Without arguments a synthetic frame source is used, so it
+# runs without a camera; pass a device path to publish captured frames.
+#
+# I, the copyright holder of this file, hereby release it into the
+# public domain. This applies worldwide. In case this is not legally
+# possible: I grant anyone the right to use this work for any
+# purpose, without any conditions, unless such conditions are
+# required by law.
+
+import multiprocessing
+import select
+import struct
+import sys
+import time
+import v4l2capture
+
+RING_NAME = "/v4l2capture-example"
+SLOT_COUNT = 8
+FRAME_SIZE = 640 * 480 * 2
+FRAME_COUNT = 300
+
+def reader(number, ready):
+    # Any process can attach to the ring by name.
+    ring = v4l2capture.Frame_ring(RING_NAME)
+    ready.set()
+    frames = 0
+    torn = 0
+    while True:
+        if not ring.wait(1.0):
+            break
+        frame = ring.read()
+        if frame is None:
+            continue
+        data, info = frame
+        # The frame is a view into shared memory. Look at it, then check
+        # that the writer didn't overwrite it meanwhile.
+        first, = struct.unpack_from("I", data, 0)
+        last, = struct.unpack_from("I", data, len(data) - 4)
+        valid = ring.is_valid(info["ring_sequence"])
+        data.release()
+        if not valid:
+            torn += 1
+        elif first != info["sequence"] or last != info["sequence"]:
+            sys.exit("reader %d: corrupt frame %d" % (number, info["sequence"]))
+        frames += 1
+    print("reader %d: %d frames, %d overruns, %d overwritten while in use" % (
+        number, frames, ring.get_overruns(), torn))
+    ring.close()
+
+def main():
+    ring = v4l2capture.Frame_ring(RING_NAME, SLOT_COUNT, FRAME_SIZE)
+    readers = []
+    for number in range(4):
+        ready = multiprocessing.Event()
+        process = multiprocessing.Process(target=reader, args=(number, ready))
+        process.start()
+        ready.wait()
+        readers.append(process)
+
+    if len(sys.argv) > 1:
+        video = v4l2capture.Video_device(sys.argv[1])
+        video.set_format(640, 480, fourcc='YUYV')
+        video.create_buffers(8)
+        video.set_frame_ring(ring)
+        video.queue_all_buffers()
+        video.start()
+        for i in range(FRAME_COUNT):
+            select.select((video,), (), ())
+            video.read_and_queue()
+        video.close()
+    else:
+        for i in range(FRAME_COUNT):
+            frame = bytearray(FRAME_SIZE)
+            struct.pack_into("I", frame, 0, i)
+            struct.pack_into("I", frame, FRAME_SIZE - 4, i)
+            ring.write(bytes(frame), timestamp=time.time(), sequence=i,
+                size_x=640, size_y=480, fourcc='YUYV')
+            time.sleep(0.001)
+
+    for process in readers:
+        process.join()
+    ring.close()
+
+if __name__ == "__main__":
+    main()
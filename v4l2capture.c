@@ -11,15 +11,34 @@
 
 #define USE_LIBV4L
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <linux/videodev2.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifdef USE_LIBV4L
 #include <libv4l2.h>
 #else
-#include <sys/ioctl.h>
 #define v4l2_close close
 #define v4l2_ioctl ioctl
 #define v4l2_mmap mmap
@@ -27,9 +46,6 @@
 #define v4l2_open open
 #endif
 
-#ifndef Py_TYPE
-    #define Py_TYPE(ob) (((PyObject*)(ob))->ob_type)
-#endif
 
 
 #define ASSERT_OPEN if(self->fd < 0)					\
@@ -41,9 +57,190 @@
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
+// Static tracepoints for perf, bpftrace and SystemTap, in the v4l2capture
+// provider. Without sys/sdt.h they compile to nothing. See trace_frames.bt.
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H
+#endif
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE1(name, a) DTRACE_PROBE1(v4l2capture, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(v4l2capture, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(v4l2capture, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(v4l2capture, name, a, b, c, d)
+#else
+#define TRACE1(name, a) do {} while(0)
+#define TRACE2(name, a, b) do {} while(0)
+#define TRACE3(name, a, b, c) do {} while(0)
+#define TRACE4(name, a, b, c, d) do {} while(0)
+#endif
+
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define TYPE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE)
+#else
+#define TYPE_FLAGS Py_TPFLAGS_DEFAULT
+#endif
+
+// Objects are locked by the methods that use them, so that concurrent calls
+// on free-threaded builds can't race on buffers or file descriptors. With
+// the GIL there is nothing to do.
+
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#define Py_BEGIN_CRITICAL_SECTION2(a, b) {
+#define Py_END_CRITICAL_SECTION2() }
+#endif
+
+#define LOCKED_NOARGS(type, name)					\
+  static PyObject *name##_locked(type *self, PyObject *unused)		\
+  {									\
+    PyObject *result;							\
+    Py_BEGIN_CRITICAL_SECTION(self);					\
+    result = name(self);						\
+    Py_END_CRITICAL_SECTION();						\
+    return result;							\
+  }
+
+#define LOCKED_VARARGS(type, name)					\
+  static PyObject *name##_locked(type *self, PyObject *args)		\
+  {									\
+    PyObject *result;							\
+    Py_BEGIN_CRITICAL_SECTION(self);					\
+    result = name(self, args);						\
+    Py_END_CRITICAL_SECTION();						\
+    return result;							\
+  }
+
+#define LOCKED_KEYWORDS(type, name)					\
+  static PyObject *name##_locked(type *self, PyObject *args,		\
+      PyObject *keywds)							\
+  {									\
+    PyObject *result;							\
+    Py_BEGIN_CRITICAL_SECTION(self);					\
+    result = name(self, args, keywds);					\
+    Py_END_CRITICAL_SECTION();						\
+    return result;							\
+  }
+
 struct buffer {
   void *start;
   size_t length;
+  int dmabuf_fd;
+};
+
+struct motion_region {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+struct motion_detector {
+  double threshold;
+  int decimation;
+  struct motion_region *regions;
+  int region_count;
+  int width;
+  int height;
+  unsigned char *reference;
+  unsigned char *current;
+  int have_reference;
+  int lock_memory;
+};
+
+struct delivery_policy {
+  unsigned int every;
+  double period;
+  unsigned long long count;
+  double next_due;
+  double last_timestamp;
+};
+
+#define STATISTICS_MAX_GRID 16
+
+struct frame_statistics {
+  int enabled;
+  int grid_x;
+  int grid_y;
+  double percentile;
+  int width;
+  unsigned char *column_cells;
+  unsigned int *cell_histograms;
+  int lock_memory;
+  int valid;
+  unsigned int histogram[256];
+  double cell_mean[STATISTICS_MAX_GRID * STATISTICS_MAX_GRID];
+  double cell_percentile[STATISTICS_MAX_GRID * STATISTICS_MAX_GRID];
+  double sharpness;
+};
+
+// Frames can be published to a ring of slots in POSIX shared memory, from
+// which any number of processes read them without copying. There is a
+// single writer. Each slot carries a sequence number that is odd while the
+// writer fills it, so readers can detect frames overwritten under them.
+
+#define FRAME_RING_MAGIC 0x52344c56
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_ALIGN 64
+
+struct frame_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint64_t data_offset;
+  uint64_t write_sequence;
+  uint32_t futex;
+  uint32_t waiters;
+};
+
+struct frame_ring_slot {
+  uint64_t sequence;
+  uint64_t frame_sequence;
+  double timestamp;
+  uint32_t bytesused;
+  uint32_t width;
+  uint32_t height;
+  uint32_t pixelformat;
+  uint32_t reserved[6];
+};
+
+typedef struct {
+  PyObject_HEAD
+  char *name;
+  int writer;
+  void *map;
+  size_t map_size;
+  struct frame_ring_header *header;
+  struct frame_ring_slot *slots;
+  unsigned char *data;
+  uint64_t next;
+  uint64_t overruns;
+  Py_ssize_t exports;
+} Frame_ring;
+
+// Everything the module needs to find at run time lives in its state, so
+// that it can be loaded into several (sub)interpreters.
+
+typedef struct {
+  PyTypeObject *Video_device_type;
+  PyTypeObject *M2M_device_type;
+  PyTypeObject *Frame_ring_type;
+  PyTypeObject *Frame_synchronizer_type;
+  PyObject *discovery_cache;
+} module_state;
+
+struct dequeue_latency {
+  unsigned long long count;
+  double min;
+  double max;
+  double mean;
+  double m2;
 };
 
 typedef struct {
@@ -51,8 +248,45 @@ typedef struct {
   int fd;
   struct buffer *buffers;
   int buffer_count;
+  struct v4l2_pix_format format;
+  struct v4l2_buffer last_buffer;
+  Frame_ring *ring;
+  struct delivery_policy delivery;
+  struct motion_detector motion;
+  struct frame_statistics stats;
+  unsigned long long frames_delivered;
+  unsigned long long frames_decimated;
+  unsigned long long frames_suppressed;
+  struct dequeue_latency latency;
+  int lock_memory;
 } Video_device;
 
+struct held_frame {
+  int index;
+  unsigned int bytesused;
+  unsigned int sequence;
+  double timestamp;
+};
+
+struct sync_stream {
+  Video_device *device;
+  struct held_frame *frames;
+  int count;
+  unsigned long long dropped;
+};
+
+typedef struct {
+  PyObject_HEAD
+  struct sync_stream *streams;
+  int stream_count;
+  int window;
+  double tolerance;
+  clockid_t clock;
+  int timestamp_source;
+  unsigned long long matched;
+  unsigned long generation;
+} Frame_synchronizer;
+
 struct capability {
   int id;
   const char *name;
@@ -77,13 +311,17 @@ static struct capability capabilities[] = {
   { V4L2_CAP_VIDEO_OVERLAY, "video_overlay" }
 };
 
-static int my_ioctl(int fd, int request, void *arg)
+static int xioctl(int fd, int request, void *arg)
 {
-  // Retry ioctl until it returns without being interrupted.
+  // Retry ioctl until it returns without being interrupted. Leaves errno
+  // set on failure so that callers can handle EAGAIN themselves.
 
   for(;;)
     {
+      TRACE2(ioctl_start, fd, (unsigned int)request);
       int result = v4l2_ioctl(fd, request, arg);
+      TRACE4(ioctl_done, fd, (unsigned int)request, result,
+	  result ? errno : 0);
 
       if(!result)
 	{
@@ -92,821 +330,5466 @@ static int my_ioctl(int fd, int request, void *arg)
 
       if(errno != EINTR)
 	{
-	  PyErr_SetFromErrno(PyExc_IOError);
-	  return 1;
+	  return -1;
 	}
     }
 }
 
-static void Video_device_unmap(Video_device *self)
-{
-  int i;
+struct constant {
+  const char *name;
+  long value;
+};
 
-  for(i = 0; i < self->buffer_count; i++)
+static struct constant constants[] = {
+  { "EVENT_ALL", V4L2_EVENT_ALL },
+  { "EVENT_VSYNC", V4L2_EVENT_VSYNC },
+  { "EVENT_EOS", V4L2_EVENT_EOS },
+  { "EVENT_CTRL", V4L2_EVENT_CTRL },
+  { "EVENT_FRAME_SYNC", V4L2_EVENT_FRAME_SYNC },
+  { "EVENT_SOURCE_CHANGE", V4L2_EVENT_SOURCE_CHANGE },
+  { "EVENT_SUB_FL_SEND_INITIAL", V4L2_EVENT_SUB_FL_SEND_INITIAL },
+  { "EVENT_SUB_FL_ALLOW_FEEDBACK", V4L2_EVENT_SUB_FL_ALLOW_FEEDBACK },
+  { "EVENT_CTRL_CH_VALUE", V4L2_EVENT_CTRL_CH_VALUE },
+  { "EVENT_CTRL_CH_FLAGS", V4L2_EVENT_CTRL_CH_FLAGS },
+  { "EVENT_CTRL_CH_RANGE", V4L2_EVENT_CTRL_CH_RANGE },
+  { "EVENT_SRC_CH_RESOLUTION", V4L2_EVENT_SRC_CH_RESOLUTION },
+  { "CID_AUTO_WHITE_BALANCE", V4L2_CID_AUTO_WHITE_BALANCE },
+  { "CID_WHITE_BALANCE_TEMPERATURE", V4L2_CID_WHITE_BALANCE_TEMPERATURE },
+  { "CID_EXPOSURE_AUTO", V4L2_CID_EXPOSURE_AUTO },
+  { "CID_EXPOSURE_ABSOLUTE", V4L2_CID_EXPOSURE_ABSOLUTE },
+  { "CID_FOCUS_AUTO", V4L2_CID_FOCUS_AUTO },
+  { "CID_GAIN", V4L2_CID_GAIN },
+  { "CID_BRIGHTNESS", V4L2_CID_BRIGHTNESS },
+  { "CLOCK_MONOTONIC", CLOCK_MONOTONIC },
+  { "CLOCK_REALTIME", CLOCK_REALTIME },
+  { "CLOCK_BOOTTIME", CLOCK_BOOTTIME }
+};
+
+static int my_ioctl(int fd, int request, void *arg)
+{
+  if(xioctl(fd, request, arg))
     {
-      v4l2_munmap(self->buffers[i].start, self->buffers[i].length);
+      PyErr_SetFromErrno(PyExc_IOError);
+      return 1;
     }
+
+  return 0;
 }
 
-static void Video_device_dealloc(Video_device *self)
+static double timeval_to_double(const struct timeval *tv)
 {
-  if(self->fd >= 0)
-    {
-      if(self->buffers)
-	{
-	  Video_device_unmap(self);
-	}
-
-      v4l2_close(self->fd);
-    }
+  return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
 
-  Py_TYPE(self)->tp_free((PyObject *)self);
+static struct timeval double_to_timeval(double seconds)
+{
+  struct timeval tv;
+  tv.tv_sec = (time_t)seconds;
+  tv.tv_usec = (suseconds_t)((seconds - tv.tv_sec) * 1000000.0);
+  return tv;
 }
 
-static int Video_device_init(Video_device *self, PyObject *args,
-    PyObject *kwargs)
+static int frame_ring_publish(Frame_ring *ring, const void *data,
+    size_t length, double timestamp, uint64_t frame_sequence,
+    const struct v4l2_pix_format *format, uint64_t *ring_sequence)
 {
-  const char *device_path;
+  if(!ring->map)
+    {
+      PyErr_SetString(PyExc_ValueError, "I/O operation on closed ring");
+      return -1;
+    }
 
-  if(!PyArg_ParseTuple(args, "s", &device_path))
+  if(!ring->writer)
     {
+      PyErr_SetString(PyExc_ValueError, "Ring was not created by this "
+	  "process");
       return -1;
     }
 
-  int fd = v4l2_open(device_path, O_RDWR | O_NONBLOCK);
+  struct frame_ring_header *header = ring->header;
 
-  if(fd < 0)
+  if(length > header->slot_size)
     {
-      PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)device_path);
+      PyErr_SetString(PyExc_ValueError, "Frame does not fit in ring slot");
       return -1;
     }
 
-  self->fd = fd;
-  self->buffers = NULL;
-  return 0;
-}
+  uint64_t n = header->write_sequence;
+  uint32_t index = n % header->slot_count;
+  struct frame_ring_slot *slot = &ring->slots[index];
 
-static PyObject *Video_device_close(Video_device *self)
-{
-  if(self->fd >= 0)
-    {
-      if(self->buffers)
-	{
-	  Video_device_unmap(self);
-	}
+  __atomic_store_n(&slot->sequence, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
 
-      v4l2_close(self->fd);
-      self->fd = -1;
+  memcpy(ring->data + (size_t)index * header->slot_size, data, length);
+  slot->frame_sequence = frame_sequence;
+  slot->timestamp = timestamp;
+  slot->bytesused = length;
+  slot->width = format ? format->width : 0;
+  slot->height = format ? format->height : 0;
+  slot->pixelformat = format ? format->pixelformat : 0;
+
+  __atomic_store_n(&slot->sequence, 2 * n + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->write_sequence, n + 1, __ATOMIC_RELEASE);
+
+  // Wake readers blocked in wait(). The futex word lives in the shared
+  // mapping, so this works across processes.
+
+  __atomic_add_fetch(&header->futex, 1, __ATOMIC_RELEASE);
+
+  if(__atomic_load_n(&header->waiters, __ATOMIC_ACQUIRE))
+    {
+      syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
     }
 
-  Py_RETURN_NONE;
+  *ring_sequence = n;
+  return 0;
 }
 
-static PyObject *Video_device_fileno(Video_device *self)
+static void lock_pages(const void *start, size_t length, int enabled)
 {
-  ASSERT_OPEN;
-#if PY_MAJOR_VERSION < 3
-  return PyInt_FromLong(self->fd);
-#else
-  return PyLong_FromLong(self->fd);
-#endif
+  // Keep buffers used in the read path from being paged out. Failures are
+  // ignored here; set_realtime reports whether locking works at all.
+
+  if(enabled && start && length)
+    {
+      mlock(start, length);
+    }
 }
 
-static PyObject *Video_device_get_info(Video_device *self)
+// Working buffers of the read path get pages of their own instead of
+// coming from the malloc arenas, whose pages were already placed on the
+// memory node of whichever thread touched them first. Fresh anonymous
+// pages are placed when the reading thread first writes to them. The size
+// is kept in front of the buffer, a cache line ahead so that the alignment
+// is kept too.
+
+#define WORKING_HEADER 64
+
+static void *working_alloc(size_t size)
 {
-  ASSERT_OPEN;
-  struct v4l2_capability caps;
+  unsigned char *map = mmap(NULL, size + WORKING_HEADER,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-  if(my_ioctl(self->fd, VIDIOC_QUERYCAP, &caps))
+  if(map == MAP_FAILED)
     {
       return NULL;
     }
 
-  PyObject *set = PySet_New(NULL);
+  *(size_t *)map = size + WORKING_HEADER;
+  return map + WORKING_HEADER;
+}
 
-  if(!set)
+static void working_free(void *start)
+{
+  if(start)
     {
-      return NULL;
+      unsigned char *map = (unsigned char *)start - WORKING_HEADER;
+      munmap(map, *(size_t *)map);
     }
+}
 
-  struct capability *capability = capabilities;
-
-  while((void *)capability < (void *)capabilities + sizeof(capabilities))
+static void working_unlock(void *start)
+{
+  if(start)
     {
-      if(caps.capabilities & capability->id)
-	{
-#if PY_MAJOR_VERSION < 3
-          PyObject *s = PyString_FromString(capability->name);
-#else
-	  PyObject *s = PyBytes_FromString(capability->name);
-#endif
-
-	  if(!s)
-	    {
-              Py_DECREF(set);
-	      return NULL;
-	    }
-
-	  PySet_Add(set, s);
-	}
-
-      capability++;
+      unsigned char *map = (unsigned char *)start - WORKING_HEADER;
+      munlock(map, *(size_t *)map);
     }
-
-  return Py_BuildValue("sssO", caps.driver, caps.card, caps.bus_info, set);
 }
 
-static PyObject *Video_device_set_format(Video_device *self, PyObject *args, PyObject *keywds)
+static void dequeue_latency_add(struct dequeue_latency *latency,
+    const struct v4l2_buffer *buffer)
 {
-  int size_x;
-  int size_y;
-  int yuv420 = 0;
-  int fourcc;
-  const char *fourcc_str;
-  int fourcc_len = 0;
-  static char *kwlist [] = {
-    "size_x",
-    "size_y",
-    "yuv420",
-    "fourcc",
-    NULL
-  };
+  // Time from the driver timestamping a frame to us dequeuing it. Only
+  // meaningful for monotonic timestamps taken at capture time.
 
-  if (!PyArg_ParseTupleAndKeywords(args, keywds, "ii|is#", kwlist, &size_x, &size_y, &yuv420, &fourcc_str, &fourcc_len))
+  if((buffer->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+      V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
     {
-      return NULL;
+      return;
     }
 
-  struct v4l2_format format;
-  CLEAR(format);
-  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  /* Get the current format */
-  if(my_ioctl(self->fd, VIDIOC_G_FMT, &format))
-  {
-    return NULL;
-  }
-
-#ifdef USE_LIBV4L
-  format.fmt.pix.pixelformat =
-    yuv420 ? V4L2_PIX_FMT_YUV420 : V4L2_PIX_FMT_RGB24;
-#else
-  format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-#endif
-  format.fmt.pix.field = V4L2_FIELD_INTERLACED;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double value = now.tv_sec + now.tv_nsec / 1000000000.0 -
+    timeval_to_double(&buffer->timestamp);
 
-  if (fourcc_len == 4) {
-    fourcc = v4l2_fourcc(fourcc_str[0],
-                       fourcc_str[1],
-                       fourcc_str[2],
-                       fourcc_str[3]);
-    format.fmt.pix.pixelformat = fourcc;
-    format.fmt.pix.field = V4L2_FIELD_ANY;
-  }
+  latency->count++;
 
-  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  format.fmt.pix.width = size_x;
-  format.fmt.pix.height = size_y;
-  format.fmt.pix.bytesperline = 0;
+  if(latency->count == 1 || value < latency->min)
+    {
+      latency->min = value;
+    }
 
-  if(my_ioctl(self->fd, VIDIOC_S_FMT, &format))
+  if(latency->count == 1 || value > latency->max)
     {
-      return NULL;
+      latency->max = value;
     }
- 
-  return Py_BuildValue("ii", format.fmt.pix.width, format.fmt.pix.height);
+
+  double delta = value - latency->mean;
+  latency->mean += delta / latency->count;
+  latency->m2 += delta * (value - latency->mean);
 }
 
-static PyObject *Video_device_set_fps(Video_device *self, PyObject *args)
+static int luma_layout(const struct v4l2_pix_format *format, int *offset,
+    int *step)
 {
-  int fps;
-  if(!PyArg_ParseTuple(args, "i", &fps))
+  // Describe where the luma samples of the first plane are: at byte
+  // 'offset' of every 'step' bytes. Returns -1 for formats without an
+  // accessible luma plane (compressed formats). For RGB the green channel
+  // stands in for luma.
+
+  switch(format->pixelformat)
     {
-      return NULL;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+      *offset = 0;
+      *step = 2;
+      return 0;
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_VYUY:
+      *offset = 1;
+      *step = 2;
+      return 0;
+    case V4L2_PIX_FMT_GREY:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+    case V4L2_PIX_FMT_YUV422P:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV61:
+      *offset = 0;
+      *step = 1;
+      return 0;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+      *offset = 1;
+      *step = 3;
+      return 0;
+    default:
+      return -1;
     }
-  struct v4l2_streamparm setfps;
-  CLEAR(setfps);
-  setfps.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  setfps.parm.capture.timeperframe.numerator = 1;
-  setfps.parm.capture.timeperframe.denominator = fps;
-  if(my_ioctl(self->fd, VIDIOC_S_PARM, &setfps)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",setfps.parm.capture.timeperframe.denominator);
 }
 
-static void get_fourcc_str(char *fourcc_str, int fourcc)
+static unsigned int luma_stride(const struct v4l2_pix_format *format,
+    int step)
 {
-  if (fourcc_str == NULL)
-     return;
-  fourcc_str[0] = (char)(fourcc & 0xFF);
-  fourcc_str[1] = (char)((fourcc >> 8) & 0xFF);
-  fourcc_str[2] = (char)((fourcc >> 16) & 0xFF);
-  fourcc_str[3] = (char)((fourcc >> 24) & 0xFF);
-  fourcc_str[4] = 0;
+  return format->bytesperline ? format->bytesperline : format->width * step;
 }
 
-static PyObject *Video_device_get_format(Video_device *self)
+static unsigned long sum_of_absolute_differences(const unsigned char *a,
+    const unsigned char *b, int n)
 {
-  struct v4l2_format format;
-  CLEAR(format);
-  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  unsigned long sum = 0;
+  int i = 0;
 
-  /* Get the current format */
-  if(my_ioctl(self->fd, VIDIOC_G_FMT, &format))
+#if defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+
+  for(; i + 16 <= n; i += 16)
     {
-      return NULL;
+      __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(x, y));
     }
 
-  char current_fourcc[5];
-  get_fourcc_str(current_fourcc, format.fmt.pix.pixelformat);
-  return Py_BuildValue("iis", format.fmt.pix.width, format.fmt.pix.height, current_fourcc);
-}
+  sum = _mm_cvtsi128_si32(acc) +
+    _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#elif defined(__ARM_NEON)
+  uint32x4_t acc = vdupq_n_u32(0);
 
-static PyObject *Video_device_get_fourcc(Video_device *self, PyObject *args)
-{
-  char *fourcc_str;
-  int size;
-  int fourcc;
-  if (!PyArg_ParseTuple(args, "s#", &fourcc_str, &size))
+  for(; i + 16 <= n; i += 16)
     {
-      return NULL;
+      uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+      acc = vpadalq_u16(acc, vpaddlq_u8(d));
     }
 
-  if(size < 4)
+  sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+    vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+  for(; i < n; i++)
     {
-      return NULL;
+      sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
     }
 
-  fourcc = v4l2_fourcc(fourcc_str[0],
-                       fourcc_str[1],
-                       fourcc_str[2],
-                       fourcc_str[3]);
-  return Py_BuildValue("i", fourcc);
+  return sum;
 }
 
-static PyObject *Video_device_set_auto_white_balance(Video_device *self, PyObject *args)
+static void motion_detector_free(struct motion_detector *motion)
 {
-#ifdef V4L2_CID_AUTO_WHITE_BALANCE
-  int autowb;
-  if(!PyArg_ParseTuple(args, "i", &autowb))
-    {
-      return NULL;
+  free(motion->regions);
+  working_free(motion->reference);
+  working_free(motion->current);
+  motion->regions = NULL;
+  motion->region_count = 0;
+  motion->reference = NULL;
+  motion->current = NULL;
+  motion->have_reference = 0;
+}
+
+static int motion_detector_changed(struct motion_detector *motion,
+    const struct v4l2_pix_format *format, const unsigned char *data,
+    unsigned int bytesused)
+{
+  // Compare a decimated luma plane of the frame against the last frame
+  // that was delivered. Returns 1 if any region differs by more than the
+  // threshold, or if the frame can't be analysed, and 0 if it is static.
+
+  int offset;
+  int step;
+
+  if(luma_layout(format, &offset, &step))
+    {
+      return 1;
     }
 
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_AUTO_WHITE_BALANCE;
-  ctrl.value = autowb;
-  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
+  unsigned int stride = luma_stride(format, step);
+
+  if(bytesused < stride * format->height)
+    {
+      return 1;
+    }
+
+  int decimation = motion->decimation;
+  int width = (format->width + decimation - 1) / decimation;
+  int height = (format->height + decimation - 1) / decimation;
+
+  if(width != motion->width || height != motion->height)
+    {
+      // First frame, or the format has changed. Start over.
+
+      working_free(motion->reference);
+      working_free(motion->current);
+      motion->reference = working_alloc(width * height);
+      motion->current = working_alloc(width * height);
+      motion->width = width;
+      motion->height = height;
+      motion->have_reference = 0;
+      lock_pages(motion->reference, width * height, motion->lock_memory);
+      lock_pages(motion->current, width * height, motion->lock_memory);
+
+      if(!motion->reference || !motion->current)
+	{
+	  working_free(motion->reference);
+	  working_free(motion->current);
+	  motion->reference = NULL;
+	  motion->current = NULL;
+	  motion->width = 0;
+	  motion->height = 0;
+	  return 1;
+	}
+    }
+
+  int x;
+  int y;
+  unsigned char *current = motion->current;
+
+  for(y = 0; y < height; y++)
+    {
+      const unsigned char *src = data + y * decimation * stride + offset;
+      int src_step = decimation * step;
+
+      if(src_step == 1)
+	{
+	  memcpy(current + y * width, src, width);
+	  continue;
+	}
+
+      for(x = 0; x < width; x++)
+	{
+	  current[y * width + x] = src[x * src_step];
+	}
+    }
+
+  int changed = !motion->have_reference;
+  struct motion_region whole = { 0, 0, format->width, format->height };
+  struct motion_region *region = motion->region_count ?
+    motion->regions : &whole;
+  struct motion_region *region_end = motion->region_count ?
+    motion->regions + motion->region_count : &whole + 1;
+
+  for(; !changed && region < region_end; region++)
+    {
+      int x0 = region->x / decimation;
+      int y0 = region->y / decimation;
+      int x1 = (region->x + region->width + decimation - 1) / decimation;
+      int y1 = (region->y + region->height + decimation - 1) / decimation;
+      x1 = x1 > width ? width : x1;
+      y1 = y1 > height ? height : y1;
+
+      if(x0 >= x1 || y0 >= y1)
+	{
+	  continue;
+	}
+
+      unsigned long long sad = 0;
+
+      for(y = y0; y < y1; y++)
+	{
+	  sad += sum_of_absolute_differences(current + y * width + x0,
+	      motion->reference + y * width + x0, x1 - x0);
+	}
+
+      changed = sad > motion->threshold * (x1 - x0) * (y1 - y0);
+    }
+
+  if(changed)
+    {
+      // The delivered frame becomes the new reference, so that slow drift
+      // (e.g. daylight) is eventually let through.
+
+      motion->current = motion->reference;
+      motion->reference = current;
+      motion->have_reference = 1;
+    }
+
+  return changed;
 }
 
-static PyObject *Video_device_get_auto_white_balance(Video_device *self)
+static PyObject *Video_device_set_motion_detection(Video_device *self,
+    PyObject *args, PyObject *keywds)
 {
-#ifdef V4L2_CID_AUTO_WHITE_BALANCE
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_AUTO_WHITE_BALANCE;
-  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
+  double threshold;
+  int decimation = 4;
+  PyObject *regions = Py_None;
+  static char *kwlist [] = {
+    "threshold",
+    "decimation",
+    "regions",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "d|iO", kwlist, &threshold,
+	  &decimation, &regions))
+    {
+      return NULL;
+    }
+
+  if(decimation < 1)
+    {
+      PyErr_SetString(PyExc_ValueError, "decimation must be at least 1");
+      return NULL;
+    }
+
+  struct motion_region *parsed = NULL;
+  Py_ssize_t count = 0;
+
+  if(regions != Py_None)
+    {
+      PyObject *sequence = PySequence_Fast(regions,
+	  "regions must be a sequence of (x, y, width, height)");
+
+      if(!sequence)
+	{
+	  return NULL;
+	}
+
+      count = PySequence_Fast_GET_SIZE(sequence);
+      parsed = malloc((count ? count : 1) * sizeof(struct motion_region));
+
+      if(!parsed)
+	{
+	  Py_DECREF(sequence);
+	  return PyErr_NoMemory();
+	}
+
+      Py_ssize_t i;
+
+      for(i = 0; i < count; i++)
+	{
+	  struct motion_region *region = &parsed[i];
+
+	  if(!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(sequence, i),
+		  "iiii;regions must be a sequence of (x, y, width, height)",
+		  &region->x, &region->y, &region->width, &region->height))
+	    {
+	      free(parsed);
+	      Py_DECREF(sequence);
+	      return NULL;
+	    }
+
+	  if(region->x < 0 || region->y < 0)
+	    {
+	      free(parsed);
+	      Py_DECREF(sequence);
+	      PyErr_SetString(PyExc_ValueError, "region is outside the frame");
+	      return NULL;
+	    }
+	}
+
+      Py_DECREF(sequence);
+    }
+
+  motion_detector_free(&self->motion);
+
+  if(threshold <= 0)
+    {
+      free(parsed);
+      self->motion.decimation = 0;
+      Py_RETURN_NONE;
+    }
+
+  self->motion.threshold = threshold;
+  self->motion.lock_memory = self->lock_memory;
+  self->motion.decimation = decimation;
+  self->motion.regions = parsed;
+  self->motion.region_count = count;
+  self->motion.width = 0;
+  self->motion.height = 0;
+  Py_RETURN_NONE;
+}
+
+static int delivery_policy_due(struct delivery_policy *delivery,
+    double timestamp)
+{
+  // Decide from the kernel timestamp whether a frame is wanted. A frame
+  // counts as on time if it is at most half a source frame interval early,
+  // so that a 30 fps source decimated to 10 fps yields every third frame
+  // despite timestamp jitter.
+
+  if(delivery->every > 1 && delivery->count++ % delivery->every)
+    {
+      return 0;
+    }
+
+  if(delivery->period <= 0)
+    {
+      return 1;
+    }
+
+  double slack = delivery->last_timestamp ?
+    (timestamp - delivery->last_timestamp) / 2 : 0;
+  delivery->last_timestamp = timestamp;
+
+  if(delivery->next_due && timestamp + slack < delivery->next_due)
+    {
+      return 0;
+    }
+
+  delivery->next_due = delivery->next_due ?
+    delivery->next_due + delivery->period : timestamp + delivery->period;
+
+  if(delivery->next_due < timestamp)
+    {
+      // Fell behind (e.g. the source stalled). Don't try to catch up.
+      delivery->next_due = timestamp + delivery->period;
+    }
+
+  return 1;
+}
+
+static int Video_device_accept(Video_device *self, struct v4l2_buffer *buffer)
+{
+  // Filters applied to every dequeued frame before it is copied. Cheap
+  // ones go first.
+
+  if(!delivery_policy_due(&self->delivery,
+	  timeval_to_double(&buffer->timestamp)))
+    {
+      self->frames_decimated++;
+      return 0;
+    }
+
+  if(self->motion.decimation &&
+      !motion_detector_changed(&self->motion, &self->format,
+	  self->buffers[buffer->index].start, buffer->bytesused))
+    {
+      self->frames_suppressed++;
+      return 0;
+    }
+
+  return 1;
+}
+
+static PyObject *Video_device_set_delivery_policy(Video_device *self,
+    PyObject *args, PyObject *keywds)
+{
+  unsigned int every = 1;
+  double fps = 0;
+  static char *kwlist [] = {
+    "every",
+    "fps",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "|Id", kwlist, &every,
+	  &fps))
+    {
+      return NULL;
+    }
+
+  if(every < 1 || fps < 0)
+    {
+      PyErr_SetString(PyExc_ValueError, "every must be at least 1 and fps "
+	  "must not be negative");
+      return NULL;
+    }
+
+  CLEAR(self->delivery);
+  self->delivery.every = every;
+  self->delivery.period = fps > 0 ? 1 / fps : 0;
+  Py_RETURN_NONE;
+}
+
+static void frame_statistics_free(struct frame_statistics *stats)
+{
+  working_free(stats->cell_histograms);
+  working_free(stats->column_cells);
+  stats->cell_histograms = NULL;
+  stats->column_cells = NULL;
+  stats->width = 0;
+  stats->valid = 0;
+}
+
+#if defined(__SSE2__)
+static inline __m128i load_luma8(const unsigned char *p, int step, int offset)
+{
+  // Load eight luma samples as 16 bit integers from a plane (step 1) or
+  // from packed YUYV/UYVY (step 2).
+
+  if(step == 1)
+    {
+      return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p),
+	  _mm_setzero_si128());
+    }
+
+  __m128i v = _mm_loadu_si128((const __m128i *)(p - offset));
+  return offset ? _mm_srli_epi16(v, 8) : _mm_and_si128(v, _mm_set1_epi16(0xff));
+}
+#endif
+
+static void laplacian_row(const unsigned char *row, unsigned int stride,
+    int width, int step, int offset, long long *sum, long long *sum_squares)
+{
+  // Accumulate the 4-neighbour Laplacian of the interior pixels of a row.
+
+  const unsigned char *up = row - stride;
+  const unsigned char *down = row + stride;
+  long long s = 0;
+  long long ss = 0;
+  int x = 1;
+
+#if defined(__SSE2__)
+  if(step <= 2)
+    {
+      __m128i acc_s = _mm_setzero_si128();
+      __m128i acc_ss = _mm_setzero_si128();
+
+      for(; x + 8 < width; x += 8)
+	{
+	  int i = x * step;
+	  __m128i c = load_luma8(row + i, step, offset);
+	  __m128i l = load_luma8(row + i - step, step, offset);
+	  __m128i r = load_luma8(row + i + step, step, offset);
+	  __m128i u = load_luma8(up + i, step, offset);
+	  __m128i d = load_luma8(down + i, step, offset);
+	  __m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2),
+	      _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+
+	  // Sums of the eight 16 bit lanes, pairwise into 32 bit lanes.
+	  acc_s = _mm_add_epi32(acc_s, _mm_madd_epi16(lap, _mm_set1_epi16(1)));
+	  __m128i sq = _mm_madd_epi16(lap, lap);
+	  acc_ss = _mm_add_epi64(acc_ss, _mm_unpacklo_epi32(sq,
+		  _mm_setzero_si128()));
+	  acc_ss = _mm_add_epi64(acc_ss, _mm_unpackhi_epi32(sq,
+		  _mm_setzero_si128()));
+	}
+
+      int lanes[4];
+      long long lanes64[2];
+      _mm_storeu_si128((__m128i *)lanes, acc_s);
+      _mm_storeu_si128((__m128i *)lanes64, acc_ss);
+      s = (long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      ss = lanes64[0] + lanes64[1];
+    }
 #endif
+
+  for(; x < width - 1; x++)
+    {
+      int i = x * step;
+      int lap = 4 * row[i] - row[i - step] - row[i + step] - up[i] - down[i];
+      s += lap;
+      ss += lap * lap;
+    }
+
+  *sum += s;
+  *sum_squares += ss;
+}
+
+static void frame_statistics_compute(struct frame_statistics *stats,
+    const struct v4l2_pix_format *format, const unsigned char *data,
+    unsigned int bytesused)
+{
+  int offset;
+  int step;
+
+  stats->valid = 0;
+
+  if(luma_layout(format, &offset, &step))
+    {
+      return;
+    }
+
+  unsigned int stride = luma_stride(format, step);
+  int width = format->width;
+  int height = format->height;
+
+  if(bytesused < stride * height || width < 3 || height < 3)
+    {
+      return;
+    }
+
+  int cells = stats->grid_x * stats->grid_y;
+
+  if(width != stats->width)
+    {
+      working_free(stats->column_cells);
+      stats->column_cells = working_alloc(width);
+
+      if(!stats->column_cells)
+	{
+	  stats->width = 0;
+	  return;
+	}
+
+      lock_pages(stats->column_cells, width, stats->lock_memory);
+      int x;
+
+      for(x = 0; x < width; x++)
+	{
+	  stats->column_cells[x] = x * stats->grid_x / width;
+	}
+
+      stats->width = width;
+    }
+
+  memset(stats->cell_histograms, 0, cells * 256 * sizeof(unsigned int));
+
+  int x;
+  int y;
+  long long sum = 0;
+  long long sum_squares = 0;
+
+  for(y = 0; y < height; y++)
+    {
+      const unsigned char *row = data + y * stride + offset;
+      unsigned int *histograms = stats->cell_histograms +
+	(y * stats->grid_y / height) * stats->grid_x * 256;
+
+      for(x = 0; x < width; x++)
+	{
+	  histograms[stats->column_cells[x] * 256 + row[x * step]]++;
+	}
+
+      if(y > 0 && y < height - 1)
+	{
+	  laplacian_row(row, stride, width, step, offset, &sum, &sum_squares);
+	}
+    }
+
+  // Reduce the per cell histograms to the frame histogram, cell means and
+  // cell percentiles.
+
+  memset(stats->histogram, 0, sizeof(stats->histogram));
+  int cell;
+
+  for(cell = 0; cell < cells; cell++)
+    {
+      unsigned int *histogram = stats->cell_histograms + cell * 256;
+      unsigned long long count = 0;
+      unsigned long long total = 0;
+      int v;
+
+      for(v = 0; v < 256; v++)
+	{
+	  stats->histogram[v] += histogram[v];
+	  count += histogram[v];
+	  total += (unsigned long long)v * histogram[v];
+	}
+
+      // Nearest rank: the value of the ceil(p / 100 * count)-th sample,
+      // counting from 0 below.
+
+      double nearest = ceil(stats->percentile * count / 100) - 1;
+      unsigned long long rank = nearest < 0 || !count ? 0 :
+	nearest >= count ? count - 1 : (unsigned long long)nearest;
+      unsigned long long seen = 0;
+
+      for(v = 0; v < 255 && seen + histogram[v] <= rank; v++)
+	{
+	  seen += histogram[v];
+	}
+
+      stats->cell_mean[cell] = count ? (double)total / count : 0;
+      stats->cell_percentile[cell] = v;
+    }
+
+  double n = (double)(width - 2) * (height - 2);
+  double mean = sum / n;
+  stats->sharpness = sum_squares / n - mean * mean;
+  stats->valid = 1;
+}
+
+static PyObject *frame_statistics_cells(struct frame_statistics *stats,
+    double *values)
+{
+  PyObject *rows = PyList_New(stats->grid_y);
+
+  if(!rows)
+    {
+      return NULL;
+    }
+
+  int x;
+  int y;
+
+  for(y = 0; y < stats->grid_y; y++)
+    {
+      PyObject *row = PyList_New(stats->grid_x);
+
+      if(!row)
+	{
+	  Py_DECREF(rows);
+	  return NULL;
+	}
+
+      PyList_SET_ITEM(rows, y, row);
+
+      for(x = 0; x < stats->grid_x; x++)
+	{
+	  PyObject *value = PyFloat_FromDouble(values[y * stats->grid_x + x]);
+
+	  if(!value)
+	    {
+	      Py_DECREF(rows);
+	      return NULL;
+	    }
+
+	  PyList_SET_ITEM(row, x, value);
+	}
+    }
+
+  return rows;
 }
 
-static PyObject *Video_device_set_white_balance_temperature(Video_device *self, PyObject *args)
+static PyObject *Video_device_set_statistics(Video_device *self,
+    PyObject *args, PyObject *keywds)
+{
+  int enable;
+  int grid_x = 4;
+  int grid_y = 4;
+  double percentile = 50;
+  static char *kwlist [] = {
+    "enable",
+    "grid_x",
+    "grid_y",
+    "percentile",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "i|iid", kwlist, &enable,
+	  &grid_x, &grid_y, &percentile))
+    {
+      return NULL;
+    }
+
+  if(grid_x < 1 || grid_y < 1 || grid_x > STATISTICS_MAX_GRID ||
+      grid_y > STATISTICS_MAX_GRID)
+    {
+      PyErr_SetString(PyExc_ValueError, "grid size must be 1 to 16");
+      return NULL;
+    }
+
+  if(percentile < 0 || percentile > 100)
+    {
+      PyErr_SetString(PyExc_ValueError, "percentile must be 0 to 100");
+      return NULL;
+    }
+
+  frame_statistics_free(&self->stats);
+  self->stats.enabled = 0;
+  self->stats.lock_memory = self->lock_memory;
+
+  if(!enable)
+    {
+      Py_RETURN_NONE;
+    }
+
+  self->stats.cell_histograms = working_alloc(grid_x * grid_y * 256 *
+      sizeof(unsigned int));
+
+  if(!self->stats.cell_histograms)
+    {
+      return PyErr_NoMemory();
+    }
+
+  lock_pages(self->stats.cell_histograms, grid_x * grid_y * 256 *
+      sizeof(unsigned int), self->lock_memory);
+  self->stats.enabled = 1;
+  self->stats.grid_x = grid_x;
+  self->stats.grid_y = grid_y;
+  self->stats.percentile = percentile;
+  Py_RETURN_NONE;
+}
+
+static PyObject *Video_device_get_frame_info(Video_device *self)
+{
+  struct v4l2_buffer *buffer = &self->last_buffer;
+  PyObject *info = Py_BuildValue("{sIsIsdsIsI}",
+      "index", buffer->index,
+      "sequence", buffer->sequence,
+      "timestamp", timeval_to_double(&buffer->timestamp),
+      "bytesused", buffer->bytesused,
+      "flags", buffer->flags);
+
+  if(!info || !self->stats.enabled || !self->stats.valid)
+    {
+      return info;
+    }
+
+  struct frame_statistics *stats = &self->stats;
+  PyObject *histogram = PyList_New(256);
+
+  if(!histogram)
+    {
+      Py_DECREF(info);
+      return NULL;
+    }
+
+  int v;
+
+  for(v = 0; v < 256; v++)
+    {
+      PyObject *count = PyLong_FromUnsignedLong(stats->histogram[v]);
+
+      if(!count)
+	{
+	  Py_DECREF(histogram);
+	  Py_DECREF(info);
+	  return NULL;
+	}
+
+      PyList_SET_ITEM(histogram, v, count);
+    }
+
+  PyObject *cell_mean = frame_statistics_cells(stats, stats->cell_mean);
+  PyObject *cell_percentile = frame_statistics_cells(stats,
+      stats->cell_percentile);
+  PyObject *sharpness = PyFloat_FromDouble(stats->sharpness);
+
+  if(!cell_mean || !cell_percentile || !sharpness ||
+      PyDict_SetItemString(info, "histogram", histogram) ||
+      PyDict_SetItemString(info, "cell_mean", cell_mean) ||
+      PyDict_SetItemString(info, "cell_percentile", cell_percentile) ||
+      PyDict_SetItemString(info, "sharpness", sharpness))
+    {
+      Py_CLEAR(info);
+    }
+
+  Py_DECREF(histogram);
+  Py_XDECREF(cell_mean);
+  Py_XDECREF(cell_percentile);
+  Py_XDECREF(sharpness);
+  return info;
+}
+
+static void Video_device_unlock_memory(Video_device *self)
+{
+  // Undo the lock_memory of set_realtime. mlock does not nest, so everything
+  // is unlocked at once. Working buffers freed since were unlocked when they
+  // were unmapped.
+
+  if(!self->lock_memory)
+    {
+      return;
+    }
+
+  int i;
+
+  for(i = 0; self->fd >= 0 && self->buffers && i < self->buffer_count; i++)
+    {
+      munlock(self->buffers[i].start, self->buffers[i].length);
+    }
+
+  if(self->ring && self->ring->map)
+    {
+      munlock(self->ring->map, self->ring->map_size);
+    }
+
+  working_unlock(self->motion.reference);
+  working_unlock(self->motion.current);
+  working_unlock(self->stats.column_cells);
+  working_unlock(self->stats.cell_histograms);
+  self->lock_memory = 0;
+  self->motion.lock_memory = 0;
+  self->stats.lock_memory = 0;
+}
+
+static PyObject *Video_device_set_frame_ring(Video_device *self,
+    PyObject *args)
+{
+  PyObject *ring;
+
+  if(!PyArg_ParseTuple(args, "O", &ring))
+    {
+      return NULL;
+    }
+
+  module_state *state = PyType_GetModuleState(Py_TYPE(self));
+
+  if(!state)
+    {
+      return NULL;
+    }
+
+  if(ring != Py_None && !PyObject_TypeCheck(ring, state->Frame_ring_type))
+    {
+      PyErr_SetString(PyExc_TypeError, "ring must be a Frame_ring or None");
+      return NULL;
+    }
+
+  // Only the process that created a ring may publish to it. Catch a reader
+  // here rather than on every frame read.
+
+  if(ring != Py_None && !((Frame_ring *)ring)->writer)
+    {
+      PyErr_SetString(PyExc_ValueError, "Ring was not created by this "
+	  "process");
+      return NULL;
+    }
+
+  if(self->lock_memory && self->ring && self->ring->map)
+    {
+      munlock(self->ring->map, self->ring->map_size);
+    }
+
+  Py_CLEAR(self->ring);
+
+  if(ring != Py_None)
+    {
+      Py_INCREF(ring);
+      self->ring = (Frame_ring *)ring;
+      lock_pages(self->ring->map, self->ring->map_size, self->lock_memory);
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *Video_device_set_realtime(Video_device *self, PyObject *args,
+    PyObject *keywds)
+{
+  PyObject *cpus = Py_None;
+  int priority = 0;
+  int lock_memory = 0;
+  static char *kwlist [] = {
+    "cpus",
+    "priority",
+    "lock_memory",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "|Oii", kwlist, &cpus,
+	  &priority, &lock_memory))
+    {
+      return NULL;
+    }
+
+  ASSERT_OPEN;
+
+  // There is no capture thread of our own, so everything applies to the
+  // calling thread, which is expected to be the one reading frames. The
+  // arguments are checked and the previous settings saved first, so that
+  // the thread is left as it was if any step fails.
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  if(cpus != Py_None)
+    {
+      PyObject *sequence = PySequence_Fast(cpus,
+	  "cpus must be a sequence of CPU numbers");
+
+      if(!sequence)
+	{
+	  return NULL;
+	}
+
+      Py_ssize_t i;
+
+      for(i = 0; i < PySequence_Fast_GET_SIZE(sequence); i++)
+	{
+	  long cpu = PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence, i));
+
+	  if(cpu == -1 && PyErr_Occurred())
+	    {
+	      Py_DECREF(sequence);
+	      return NULL;
+	    }
+
+	  if(cpu < 0 || cpu >= CPU_SETSIZE)
+	    {
+	      Py_DECREF(sequence);
+	      PyErr_SetString(PyExc_ValueError, "CPU number out of range");
+	      return NULL;
+	    }
+
+	  CPU_SET(cpu, &set);
+	}
+
+      Py_DECREF(sequence);
+    }
+
+  if(priority > 0 && (priority < sched_get_priority_min(SCHED_FIFO) ||
+	  priority > sched_get_priority_max(SCHED_FIFO)))
+    {
+      PyErr_SetString(PyExc_ValueError, "priority out of range for "
+	  "SCHED_FIFO");
+      return NULL;
+    }
+
+  // The working buffers of the read path are allocated again once the
+  // thread is pinned, so that their pages are placed on the memory node of
+  // its CPUs when it first writes to them, and so that they get locked.
+
+  size_t histogram_size = self->stats.grid_x * self->stats.grid_y * 256 *
+    sizeof(unsigned int);
+  unsigned int *histograms = NULL;
+
+  if(self->stats.enabled)
+    {
+      histograms = working_alloc(histogram_size);
+
+      if(!histograms)
+	{
+	  return PyErr_NoMemory();
+	}
+    }
+
+  cpu_set_t old_set;
+  int old_policy;
+  struct sched_param old_param;
+  int failed = 0;
+  int i = 0;
+
+  if(sched_getaffinity(0, sizeof(old_set), &old_set) ||
+      (errno = pthread_getschedparam(pthread_self(), &old_policy,
+	  &old_param)))
+    {
+      failed = 1;
+    }
+  else if(cpus != Py_None && sched_setaffinity(0, sizeof(set), &set))
+    {
+      failed = 1;
+    }
+  else if(priority > 0)
+    {
+      struct sched_param param;
+      CLEAR(param);
+      param.sched_priority = priority;
+      errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+      if(errno)
+	{
+	  failed = 2;
+	}
+    }
+
+  if(!failed && lock_memory && !self->lock_memory)
+    {
+      for(i = 0; self->buffers && i < self->buffer_count; i++)
+	{
+	  if(mlock(self->buffers[i].start, self->buffers[i].length))
+	    {
+	      failed = 3;
+	      break;
+	    }
+	}
+
+      if(!failed && self->ring && mlock(self->ring->map,
+	      self->ring->map_size))
+	{
+	  failed = 3;
+	}
+    }
+
+  if(failed)
+    {
+      // Undo whatever was applied, in reverse order.
+
+      PyErr_SetFromErrno(PyExc_IOError);
+      working_free(histograms);
+
+      if(failed >= 3)
+	{
+	  while(i--)
+	    {
+	      munlock(self->buffers[i].start, self->buffers[i].length);
+	    }
+
+	  pthread_setschedparam(pthread_self(), old_policy, &old_param);
+	}
+
+      if(failed >= 2)
+	{
+	  sched_setaffinity(0, sizeof(old_set), &old_set);
+	}
+
+      return NULL;
+    }
+
+  if(lock_memory)
+    {
+      self->lock_memory = 1;
+      self->motion.lock_memory = 1;
+      self->stats.lock_memory = 1;
+    }
+  else
+    {
+      Video_device_unlock_memory(self);
+    }
+
+  self->motion.width = 0;
+  self->motion.height = 0;
+  self->stats.width = 0;
+
+  if(histograms)
+    {
+      memset(histograms, 0, histogram_size);
+      lock_pages(histograms, histogram_size, self->lock_memory);
+      working_free(self->stats.cell_histograms);
+      self->stats.cell_histograms = histograms;
+      self->stats.valid = 0;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *Video_device_get_latency(Video_device *self, PyObject *args,
+    PyObject *keywds)
+{
+  int reset = 0;
+  static char *kwlist [] = {
+    "reset",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "|i", kwlist, &reset))
+    {
+      return NULL;
+    }
+
+  struct dequeue_latency *latency = &self->latency;
+  PyObject *result = Py_BuildValue("{sKsdsdsdsd}",
+      "count", latency->count,
+      "min", latency->min,
+      "max", latency->max,
+      "mean", latency->mean,
+      "jitter", latency->count > 1 ?
+      sqrt(latency->m2 / (latency->count - 1)) : 0.0);
+
+  if(result && reset)
+    {
+      CLEAR(self->latency);
+    }
+
+  return result;
+}
+
+static PyObject *Video_device_get_frame_counters(Video_device *self)
+{
+  return Py_BuildValue("{sKsKsK}",
+      "delivered", self->frames_delivered,
+      "decimated", self->frames_decimated,
+      "suppressed", self->frames_suppressed);
+}
+
+static void Video_device_unmap(Video_device *self)
+{
+  int i;
+
+  for(i = 0; i < self->buffer_count; i++)
+    {
+      v4l2_munmap(self->buffers[i].start, self->buffers[i].length);
+
+      if(self->buffers[i].dmabuf_fd >= 0)
+	{
+	  close(self->buffers[i].dmabuf_fd);
+	}
+    }
+}
+
+static void Video_device_dealloc(Video_device *self)
+{
+  Video_device_unlock_memory(self);
+
+  if(self->fd >= 0)
+    {
+      if(self->buffers)
+	{
+	  Video_device_unmap(self);
+	}
+
+      v4l2_close(self->fd);
+    }
+
+  motion_detector_free(&self->motion);
+  frame_statistics_free(&self->stats);
+  Py_XDECREF(self->ring);
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free((PyObject *)self);
+  Py_DECREF(type);
+}
+
+static int Video_device_init(Video_device *self, PyObject *args,
+    PyObject *kwargs)
+{
+  const char *device_path;
+
+  if(!PyArg_ParseTuple(args, "s", &device_path))
+    {
+      return -1;
+    }
+
+  int fd = v4l2_open(device_path, O_RDWR | O_NONBLOCK);
+
+  if(fd < 0)
+    {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)device_path);
+      return -1;
+    }
+
+  self->fd = fd;
+  self->buffers = NULL;
+  CLEAR(self->format);
+  CLEAR(self->last_buffer);
+  self->ring = NULL;
+  CLEAR(self->delivery);
+  self->delivery.every = 1;
+  CLEAR(self->motion);
+  CLEAR(self->stats);
+  self->frames_delivered = 0;
+  self->frames_decimated = 0;
+  self->frames_suppressed = 0;
+  CLEAR(self->latency);
+  self->lock_memory = 0;
+  return 0;
+}
+
+static PyObject *Video_device_close(Video_device *self)
+{
+  Video_device_unlock_memory(self);
+
+  if(self->fd >= 0)
+    {
+      if(self->buffers)
+	{
+	  Video_device_unmap(self);
+	}
+
+      v4l2_close(self->fd);
+      self->fd = -1;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *Video_device_fileno(Video_device *self)
+{
+  ASSERT_OPEN;
+  return PyLong_FromLong(self->fd);
+}
+
+static PyObject *capability_set(uint32_t mask)
+{
+  PyObject *set = PySet_New(NULL);
+
+  if(!set)
+    {
+      return NULL;
+    }
+
+  struct capability *capability = capabilities;
+
+  while((void *)capability < (void *)capabilities + sizeof(capabilities))
+    {
+      if(mask & capability->id)
+	{
+	  PyObject *s = PyBytes_FromString(capability->name);
+
+	  if(!s || PySet_Add(set, s))
+	    {
+	      Py_XDECREF(s);
+	      Py_DECREF(set);
+	      return NULL;
+	    }
+
+	  Py_DECREF(s);
+	}
+
+      capability++;
+    }
+
+  return set;
+}
+
+static PyObject *device_get_info(int fd)
+{
+  struct v4l2_capability caps;
+
+  if(my_ioctl(fd, VIDIOC_QUERYCAP, &caps))
+    {
+      return NULL;
+    }
+
+  PyObject *set = capability_set(caps.capabilities);
+
+  if(!set)
+    {
+      return NULL;
+    }
+
+  return Py_BuildValue("sssN", caps.driver, caps.card, caps.bus_info, set);
+}
+
+static PyObject *device_subscribe_event(int fd, PyObject *args,
+    PyObject *keywds, unsigned long request)
+{
+  int type;
+  int id = 0;
+  int flags = 0;
+  static char *kwlist [] = {
+    "type",
+    "id",
+    "flags",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "i|ii", kwlist, &type, &id,
+	  &flags))
+    {
+      return NULL;
+    }
+
+  struct v4l2_event_subscription subscription;
+  CLEAR(subscription);
+  subscription.type = type;
+  subscription.id = id;
+  subscription.flags = request == VIDIOC_SUBSCRIBE_EVENT ? flags : 0;
+
+  if(my_ioctl(fd, request, &subscription))
+    {
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *device_dequeue_events(int fd)
+{
+  // Drain the event queue in one call. The driver reports how many events
+  // are still pending, which saves the final ENOENT round trip.
+
+  PyObject *list = PyList_New(0);
+
+  if(!list)
+    {
+      return NULL;
+    }
+
+  for(;;)
+    {
+      struct v4l2_event event;
+      CLEAR(event);
+
+      if(xioctl(fd, VIDIOC_DQEVENT, &event))
+	{
+	  if(errno == ENOENT)
+	    {
+	      break;
+	    }
+
+	  Py_DECREF(list);
+	  PyErr_SetFromErrno(PyExc_IOError);
+	  return NULL;
+	}
+
+      PyObject *data;
+
+      switch(event.type)
+	{
+	case V4L2_EVENT_CTRL:
+	  data = Py_BuildValue("IL", event.u.ctrl.changes,
+	      event.u.ctrl.type == V4L2_CTRL_TYPE_INTEGER64 ?
+	      (long long)event.u.ctrl.value64 : (long long)event.u.ctrl.value);
+	  break;
+	case V4L2_EVENT_SOURCE_CHANGE:
+	  data = Py_BuildValue("I", event.u.src_change.changes);
+	  break;
+	case V4L2_EVENT_FRAME_SYNC:
+	  data = Py_BuildValue("I", event.u.frame_sync.frame_sequence);
+	  break;
+	default:
+	  Py_INCREF(Py_None);
+	  data = Py_None;
+	  break;
+	}
+
+      PyObject *item = data ? Py_BuildValue("IIIdN", event.type, event.id,
+	  event.sequence, event.timestamp.tv_sec +
+	  event.timestamp.tv_nsec / 1000000000.0, data) : NULL;
+
+      if(!item || PyList_Append(list, item))
+	{
+	  Py_XDECREF(item);
+	  Py_DECREF(list);
+	  return NULL;
+	}
+
+      Py_DECREF(item);
+
+      if(!event.pending)
+	{
+	  break;
+	}
+    }
+
+  return list;
+}
+
+static PyObject *Video_device_get_info(Video_device *self)
+{
+  ASSERT_OPEN;
+  return device_get_info(self->fd);
+}
+
+static PyObject *Video_device_subscribe_event(Video_device *self,
+    PyObject *args, PyObject *keywds)
+{
+  ASSERT_OPEN;
+  return device_subscribe_event(self->fd, args, keywds,
+      VIDIOC_SUBSCRIBE_EVENT);
+}
+
+static PyObject *Video_device_unsubscribe_event(Video_device *self,
+    PyObject *args, PyObject *keywds)
+{
+  ASSERT_OPEN;
+  return device_subscribe_event(self->fd, args, keywds,
+      VIDIOC_UNSUBSCRIBE_EVENT);
+}
+
+static PyObject *Video_device_dequeue_events(Video_device *self)
+{
+  ASSERT_OPEN;
+  return device_dequeue_events(self->fd);
+}
+
+static PyObject *Video_device_set_format(Video_device *self, PyObject *args, PyObject *keywds)
+{
+  int size_x;
+  int size_y;
+  int yuv420 = 0;
+  int fourcc;
+  const char *fourcc_str;
+  Py_ssize_t fourcc_len = 0;
+  static char *kwlist [] = {
+    "size_x",
+    "size_y",
+    "yuv420",
+    "fourcc",
+    NULL
+  };
+
+  if (!PyArg_ParseTupleAndKeywords(args, keywds, "ii|is#", kwlist, &size_x, &size_y, &yuv420, &fourcc_str, &fourcc_len))
+    {
+      return NULL;
+    }
+
+  struct v4l2_format format;
+  CLEAR(format);
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  /* Get the current format */
+  if(my_ioctl(self->fd, VIDIOC_G_FMT, &format))
+  {
+    return NULL;
+  }
+
+#ifdef USE_LIBV4L
+  format.fmt.pix.pixelformat =
+    yuv420 ? V4L2_PIX_FMT_YUV420 : V4L2_PIX_FMT_RGB24;
+#else
+  format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+#endif
+  format.fmt.pix.field = V4L2_FIELD_INTERLACED;
+
+  if (fourcc_len == 4) {
+    fourcc = v4l2_fourcc(fourcc_str[0],
+                       fourcc_str[1],
+                       fourcc_str[2],
+                       fourcc_str[3]);
+    format.fmt.pix.pixelformat = fourcc;
+    format.fmt.pix.field = V4L2_FIELD_ANY;
+  }
+
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.fmt.pix.width = size_x;
+  format.fmt.pix.height = size_y;
+  format.fmt.pix.bytesperline = 0;
+
+  if(my_ioctl(self->fd, VIDIOC_S_FMT, &format))
+    {
+      return NULL;
+    }
+ 
+  return Py_BuildValue("ii", format.fmt.pix.width, format.fmt.pix.height);
+}
+
+static PyObject *Video_device_set_fps(Video_device *self, PyObject *args)
+{
+  int fps;
+  if(!PyArg_ParseTuple(args, "i", &fps))
+    {
+      return NULL;
+    }
+  struct v4l2_streamparm setfps;
+  CLEAR(setfps);
+  setfps.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  setfps.parm.capture.timeperframe.numerator = 1;
+  setfps.parm.capture.timeperframe.denominator = fps;
+  if(my_ioctl(self->fd, VIDIOC_S_PARM, &setfps)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",setfps.parm.capture.timeperframe.denominator);
+}
+
+static void get_fourcc_str(char *fourcc_str, int fourcc)
+{
+  if (fourcc_str == NULL)
+     return;
+  fourcc_str[0] = (char)(fourcc & 0xFF);
+  fourcc_str[1] = (char)((fourcc >> 8) & 0xFF);
+  fourcc_str[2] = (char)((fourcc >> 16) & 0xFF);
+  fourcc_str[3] = (char)((fourcc >> 24) & 0xFF);
+  fourcc_str[4] = 0;
+}
+
+static PyObject *Video_device_get_format(Video_device *self)
+{
+  struct v4l2_format format;
+  CLEAR(format);
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  /* Get the current format */
+  if(my_ioctl(self->fd, VIDIOC_G_FMT, &format))
+    {
+      return NULL;
+    }
+
+  char current_fourcc[5];
+  get_fourcc_str(current_fourcc, format.fmt.pix.pixelformat);
+  return Py_BuildValue("iis", format.fmt.pix.width, format.fmt.pix.height, current_fourcc);
+}
+
+static PyObject *Video_device_get_fourcc(Video_device *self, PyObject *args)
+{
+  char *fourcc_str;
+  Py_ssize_t size;
+  int fourcc;
+  if (!PyArg_ParseTuple(args, "s#", &fourcc_str, &size))
+    {
+      return NULL;
+    }
+
+  if(size < 4)
+    {
+      return NULL;
+    }
+
+  fourcc = v4l2_fourcc(fourcc_str[0],
+                       fourcc_str[1],
+                       fourcc_str[2],
+                       fourcc_str[3]);
+  return Py_BuildValue("i", fourcc);
+}
+
+static PyObject *Video_device_set_auto_white_balance(Video_device *self, PyObject *args)
+{
+#ifdef V4L2_CID_AUTO_WHITE_BALANCE
+  int autowb;
+  if(!PyArg_ParseTuple(args, "i", &autowb))
+    {
+      return NULL;
+    }
+
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_AUTO_WHITE_BALANCE;
+  ctrl.value = autowb;
+  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_get_auto_white_balance(Video_device *self)
+{
+#ifdef V4L2_CID_AUTO_WHITE_BALANCE
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_AUTO_WHITE_BALANCE;
+  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_set_white_balance_temperature(Video_device *self, PyObject *args)
+{
+#ifdef V4L2_CID_WHITE_BALANCE_TEMPERATURE
+  int wb;
+  if(!PyArg_ParseTuple(args, "i", &wb))
+    {
+      return NULL;
+    }
+
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_WHITE_BALANCE_TEMPERATURE;
+  ctrl.value = wb;
+  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_get_white_balance_temperature(Video_device *self)
+{
+#ifdef V4L2_CID_WHITE_BALANCE_TEMPERATURE
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_WHITE_BALANCE_TEMPERATURE;
+  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_set_exposure_absolute(Video_device *self, PyObject *args)
+{
+#ifdef V4L2_CID_EXPOSURE_ABSOLUTE
+  int exposure;
+  if(!PyArg_ParseTuple(args, "i", &exposure))
+    {
+      return NULL;
+    }
+
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_EXPOSURE_ABSOLUTE;
+  ctrl.value = exposure;
+  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_get_exposure_absolute(Video_device *self)
+{
+#ifdef V4L2_CID_EXPOSURE_ABSOLUTE
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_EXPOSURE_ABSOLUTE;
+  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_set_exposure_auto(Video_device *self, PyObject *args)
+{
+#ifdef V4L2_CID_EXPOSURE_AUTO
+  int autoexposure;
+  if(!PyArg_ParseTuple(args, "i", &autoexposure))
+    {
+      return NULL;
+    }
+
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_EXPOSURE_AUTO;
+  ctrl.value = autoexposure;
+  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_get_exposure_auto(Video_device *self)
+{
+#ifdef V4L2_CID_EXPOSURE_AUTO
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_EXPOSURE_AUTO;
+  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_set_focus_auto(Video_device *self, PyObject *args)
+{
+#ifdef V4L2_CID_FOCUS_AUTO
+  int autofocus;
+  if(!PyArg_ParseTuple(args, "i", &autofocus))
+    {
+      return NULL;
+    }
+
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_FOCUS_AUTO;
+  ctrl.value = autofocus;
+  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_get_focus_auto(Video_device *self)
+{
+#ifdef V4L2_CID_FOCUS_AUTO
+  struct v4l2_control ctrl;
+  CLEAR(ctrl);
+  ctrl.id    = V4L2_CID_FOCUS_AUTO;
+  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
+  	return NULL;
+  }
+  return Py_BuildValue("i",ctrl.value);
+#else
+  return NULL;
+#endif
+}
+
+static PyObject *Video_device_start(Video_device *self)
+{
+  ASSERT_OPEN;
+  enum v4l2_buf_type type;
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  if(my_ioctl(self->fd, VIDIOC_STREAMON, &type))
+    {
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *Video_device_stop(Video_device *self)
+{
+  ASSERT_OPEN;
+  enum v4l2_buf_type type;
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  if(my_ioctl(self->fd, VIDIOC_STREAMOFF, &type))
+    {
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *Video_device_create_buffers(Video_device *self, PyObject *args)
+{
+  int buffer_count;
+
+  if(!PyArg_ParseTuple(args, "I", &buffer_count))
+    {
+      return NULL;
+    }
+
+  ASSERT_OPEN;
+
+  if(self->buffers)
+    {
+      PyErr_SetString(PyExc_ValueError, "Buffers are already created");
+      return NULL;
+    }
+
+  // Remember the format the buffers are going to be filled with, for the
+  // processing done in the read path.
+
+  struct v4l2_format format;
+  CLEAR(format);
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  if(my_ioctl(self->fd, VIDIOC_G_FMT, &format))
+    {
+      return NULL;
+    }
+
+  self->format = format.fmt.pix;
+
+  struct v4l2_requestbuffers reqbuf;
+  reqbuf.count = buffer_count;
+  reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  reqbuf.memory = V4L2_MEMORY_MMAP;
+
+  if(my_ioctl(self->fd, VIDIOC_REQBUFS, &reqbuf))
+    {
+      return NULL;
+    }
+
+  if(!reqbuf.count)
+    {
+      PyErr_SetString(PyExc_IOError, "Not enough buffer memory");
+      return NULL;
+    }
+
+  TRACE2(create_buffers, self->fd, reqbuf.count);
+  self->buffers = malloc(reqbuf.count * sizeof(struct buffer));
+
+  if(!self->buffers)
+    {
+      PyErr_NoMemory();
+      return NULL;
+    }
+
+  int i;
+
+  for(i = 0; i < reqbuf.count; i++)
+    {
+      struct v4l2_buffer buffer;
+      buffer.index = i;
+      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buffer.memory = V4L2_MEMORY_MMAP;
+
+      if(my_ioctl(self->fd, VIDIOC_QUERYBUF, &buffer))
+	{
+	  return NULL;
+	}
+
+      self->buffers[i].length = buffer.length;
+      self->buffers[i].dmabuf_fd = -1;
+      self->buffers[i].start = v4l2_mmap(NULL, buffer.length,
+	  PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, buffer.m.offset);
+
+      if(self->buffers[i].start == MAP_FAILED)
+	{
+	  PyErr_SetFromErrno(PyExc_IOError);
+	  return NULL;
+	}
+
+      lock_pages(self->buffers[i].start, buffer.length, self->lock_memory);
+      TRACE3(buffer_mapped, self->fd, i, buffer.length);
+    }
+
+  self->buffer_count = i;
+  Py_RETURN_NONE;
+}
+
+static PyObject *Video_device_queue_all_buffers(Video_device *self)
+{
+  if(!self->buffers)
+    {
+      ASSERT_OPEN;
+      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
+      return NULL;
+    }
+
+  int i;
+  int buffer_count = self->buffer_count;
+
+  for(i = 0; i < buffer_count; i++)
+    {
+      struct v4l2_buffer buffer;
+      buffer.index = i;
+      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buffer.memory = V4L2_MEMORY_MMAP;
+
+      if(my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+	{
+	  return NULL;
+	}
+    }
+
+  Py_RETURN_NONE;
+}
+
+static int Video_device_export(Video_device *self)
+{
+  // Export every mapped buffer as a DMABUF file descriptor so that other
+  // devices can read the image data without copying it. Buffers that have
+  // already been exported keep their descriptor.
+
+  int i;
+
+  for(i = 0; i < self->buffer_count; i++)
+    {
+      if(self->buffers[i].dmabuf_fd >= 0)
+	{
+	  continue;
+	}
+
+      struct v4l2_exportbuffer expbuf;
+      CLEAR(expbuf);
+      expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      expbuf.index = i;
+      expbuf.flags = O_CLOEXEC | O_RDWR;
+
+      if(my_ioctl(self->fd, VIDIOC_EXPBUF, &expbuf))
+	{
+	  return 1;
+	}
+
+      self->buffers[i].dmabuf_fd = expbuf.fd;
+    }
+
+  return 0;
+}
+
+static PyObject *Video_device_export_buffers(Video_device *self)
+{
+  if(!self->buffers)
+    {
+      ASSERT_OPEN;
+      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
+      return NULL;
+    }
+
+  if(Video_device_export(self))
+    {
+      return NULL;
+    }
+
+  PyObject *list = PyList_New(self->buffer_count);
+
+  if(!list)
+    {
+      return NULL;
+    }
+
+  int i;
+
+  for(i = 0; i < self->buffer_count; i++)
+    {
+      PyObject *fd = PyLong_FromLong(self->buffers[i].dmabuf_fd);
+
+      if(!fd)
+	{
+	  Py_DECREF(list);
+	  return NULL;
+	}
+
+      PyList_SET_ITEM(list, i, fd);
+    }
+
+  return list;
+}
+
+static int Video_device_requeue(Video_device *self, struct v4l2_buffer *buffer)
+{
+  TRACE3(queue_start, self->fd, buffer->index, buffer->sequence);
+  int result = my_ioctl(self->fd, VIDIOC_QBUF, buffer);
+  TRACE3(queue_done, self->fd, buffer->index, buffer->sequence);
+  return result;
+}
+
+static PyObject *Video_device_read_internal(Video_device *self, int queue)
+{
+  if(!self->buffers)
+    {
+      ASSERT_OPEN;
+      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
+      return NULL;
+    }
+
+  struct v4l2_buffer buffer;
+  int skipped = 0;
+
+  for(;;)
+    {
+      CLEAR(buffer);
+      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buffer.memory = V4L2_MEMORY_MMAP;
+
+      // With libv4l, the dequeue stage includes the format conversion.
+
+      TRACE1(dequeue_start, self->fd);
+
+      if(xioctl(self->fd, VIDIOC_DQBUF, &buffer))
+	{
+	  if(skipped && errno == EAGAIN)
+	    {
+	      // Every frame that was ready has been dropped.
+	      Py_RETURN_NONE;
+	    }
+
+	  PyErr_SetFromErrno(PyExc_IOError);
+	  return NULL;
+	}
+
+      TRACE4(dequeue_done, self->fd, buffer.index, buffer.sequence,
+	  buffer.bytesused);
+      dequeue_latency_add(&self->latency, &buffer);
+
+      if(Video_device_accept(self, &buffer))
+	{
+	  break;
+	}
+
+      // Give the frame straight back to the device without copying it,
+      // whether or not the caller asked for the buffer to be queued.
+
+      TRACE3(frame_skipped, self->fd, buffer.index, buffer.sequence);
+      skipped = 1;
+
+      if(my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+	{
+	  return NULL;
+	}
+    }
+
+  self->frames_delivered++;
+  self->last_buffer = buffer;
+
+  if(self->stats.enabled)
+    {
+      frame_statistics_compute(&self->stats, &self->format,
+	  self->buffers[buffer.index].start, buffer.bytesused);
+    }
+
+  TRACE4(copy_start, self->fd, buffer.index, buffer.sequence,
+      buffer.bytesused);
+
+  if(self->ring)
+    {
+      // Publish straight from the capture buffer instead of returning it.
+
+      uint64_t ring_sequence;
+      int failed;
+      Frame_ring *ring = self->ring;
+      Py_INCREF(ring);
+
+      // Lock the device again together with the ring. Waiting for the ring
+      // alone would suspend the device's lock, which would let another
+      // thread close the device and unmap the buffer being published. The
+      // device may still have been closed while this thread waited.
+
+      Py_BEGIN_CRITICAL_SECTION2(self, ring);
+
+      if(self->fd < 0 || !self->buffers)
+	{
+	  PyErr_SetString(PyExc_ValueError, "I/O operation on closed file");
+	  failed = -1;
+	}
+      else
+	{
+	  failed = frame_ring_publish(ring,
+	      self->buffers[buffer.index].start, buffer.bytesused,
+	      timeval_to_double(&buffer.timestamp), buffer.sequence,
+	      &self->format, &ring_sequence);
+
+	  if(failed)
+	    {
+	      xioctl(self->fd, VIDIOC_QBUF, &buffer);
+	    }
+	}
+
+      Py_END_CRITICAL_SECTION2();
+      Py_DECREF(ring);
+
+      if(failed)
+	{
+	  return NULL;
+	}
+
+      TRACE4(copy_done, self->fd, buffer.index, buffer.sequence,
+	  buffer.bytesused);
+
+      if(queue && Video_device_requeue(self, &buffer))
+	{
+	  return NULL;
+	}
+
+      TRACE3(read_done, self->fd, buffer.index, buffer.sequence);
+      return PyLong_FromUnsignedLongLong(ring_sequence);
+    }
+
+#ifdef USE_LIBV4L
+  PyObject *result = PyBytes_FromStringAndSize(
+      self->buffers[buffer.index].start, buffer.bytesused);
+
+  if(!result)
+    {
+      return NULL;
+    }
+#else
+  // Convert buffer from YUYV to RGB.
+  // For the byte order, see: http://v4l2spec.bytesex.org/spec/r4339.htm
+  // For the color conversion, see: http://v4l2spec.bytesex.org/spec/x2123.htm
+  int length = buffer.bytesused * 6 / 4;
+  PyObject *result = PyBytes_FromStringAndSize(NULL, length);
+
+  if(!result)
+    {
+      return NULL;
+    }
+
+  char *rgb = PyBytes_AS_STRING(result);
+  char *rgb_max = rgb + length;
+  unsigned char *yuyv = self->buffers[buffer.index].start;
+
+#define CLAMP(c) ((c) <= 0 ? 0 : (c) >= 65025 ? 255 : (c) >> 8)
+  while(rgb < rgb_max)
+    {
+      int u = yuyv[1] - 128;
+      int v = yuyv[3] - 128;
+      int uv = 100 * u + 208 * v;
+      u *= 516;
+      v *= 409;
+
+      int y = 298 * (yuyv[0] - 16);
+      rgb[0] = CLAMP(y + v);
+      rgb[1] = CLAMP(y - uv);
+      rgb[2] = CLAMP(y + u);
+
+      y = 298 * (yuyv[2] - 16);
+      rgb[3] = CLAMP(y + v);
+      rgb[4] = CLAMP(y - uv);
+      rgb[5] = CLAMP(y + u);
+
+      rgb += 6;
+      yuyv += 4;
+    }
+#undef CLAMP
+#endif
+
+  TRACE4(copy_done, self->fd, buffer.index, buffer.sequence,
+      PyBytes_GET_SIZE(result));
+
+  if(queue && Video_device_requeue(self, &buffer))
+    {
+      Py_DECREF(result);
+      return NULL;
+    }
+
+  TRACE3(read_done, self->fd, buffer.index, buffer.sequence);
+  return result;
+}
+
+static PyObject *Video_device_read(Video_device *self)
+{
+  return Video_device_read_internal(self, 0);
+}
+
+static PyObject *Video_device_read_and_queue(Video_device *self)
+{
+  return Video_device_read_internal(self, 1);
+}
+
+static PyObject *Video_device_wait_and_read(Video_device *self,
+    PyObject *args, PyObject *keywds)
+{
+  double timeout = -1;
+  int queue = 0;
+  static char *kwlist [] = {
+    "timeout",
+    "queue",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "|dp", kwlist, &timeout,
+	  &queue))
+    {
+      return NULL;
+    }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t)timeout;
+  deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000.0);
+
+  if(deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  // Frames dropped by the delivery policy or motion detection are queued
+  // again here, so the caller only wakes up for the frames it wants.
+
+  for(;;)
+    {
+      ASSERT_OPEN;
+
+      int wait = -1;
+
+      if(timeout >= 0)
+	{
+	  struct timespec now;
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  double remaining = deadline.tv_sec - now.tv_sec +
+	    (deadline.tv_nsec - now.tv_nsec) / 1000000000.0;
+	  wait = remaining > 0 ? (int)ceil(remaining * 1000) : 0;
+	}
+
+      struct pollfd pollfd;
+      pollfd.fd = self->fd;
+      pollfd.events = POLLIN;
+      pollfd.revents = 0;
+      int ready;
+
+      Py_BEGIN_ALLOW_THREADS
+      ready = poll(&pollfd, 1, wait);
+      Py_END_ALLOW_THREADS
+
+      if(ready < 0)
+	{
+	  if(errno != EINTR)
+	    {
+	      PyErr_SetFromErrno(PyExc_IOError);
+	      return NULL;
+	    }
+
+	  if(PyErr_CheckSignals())
+	    {
+	      return NULL;
+	    }
+
+	  continue;
+	}
+
+      if(!ready)
+	{
+	  Py_RETURN_NONE;
+	}
+
+      // The device may have been closed or read by another thread while
+      // this one waited, which read_internal reports.
+
+      PyObject *result = Video_device_read_internal(self, queue);
+
+      if(!result && PyErr_ExceptionMatches(PyExc_BlockingIOError))
+	{
+	  PyErr_Clear();
+	}
+      else if(result != Py_None)
+	{
+	  return result;
+	}
+      else
+	{
+	  Py_DECREF(result);
+	}
+
+      if(!wait)
+	{
+	  Py_RETURN_NONE;
+	}
+    }
+}
+
+LOCKED_NOARGS(Video_device, Video_device_close)
+LOCKED_NOARGS(Video_device, Video_device_fileno)
+LOCKED_NOARGS(Video_device, Video_device_get_info)
+LOCKED_KEYWORDS(Video_device, Video_device_subscribe_event)
+LOCKED_KEYWORDS(Video_device, Video_device_unsubscribe_event)
+LOCKED_NOARGS(Video_device, Video_device_dequeue_events)
+LOCKED_NOARGS(Video_device, Video_device_get_format)
+LOCKED_KEYWORDS(Video_device, Video_device_set_format)
+LOCKED_VARARGS(Video_device, Video_device_set_fps)
+LOCKED_VARARGS(Video_device, Video_device_set_auto_white_balance)
+LOCKED_NOARGS(Video_device, Video_device_get_auto_white_balance)
+LOCKED_VARARGS(Video_device, Video_device_set_white_balance_temperature)
+LOCKED_NOARGS(Video_device, Video_device_get_white_balance_temperature)
+LOCKED_VARARGS(Video_device, Video_device_set_exposure_auto)
+LOCKED_NOARGS(Video_device, Video_device_get_exposure_auto)
+LOCKED_VARARGS(Video_device, Video_device_set_exposure_absolute)
+LOCKED_NOARGS(Video_device, Video_device_get_exposure_absolute)
+LOCKED_VARARGS(Video_device, Video_device_set_focus_auto)
+LOCKED_NOARGS(Video_device, Video_device_get_focus_auto)
+LOCKED_NOARGS(Video_device, Video_device_start)
+LOCKED_NOARGS(Video_device, Video_device_stop)
+LOCKED_VARARGS(Video_device, Video_device_create_buffers)
+LOCKED_NOARGS(Video_device, Video_device_queue_all_buffers)
+LOCKED_NOARGS(Video_device, Video_device_export_buffers)
+LOCKED_KEYWORDS(Video_device, Video_device_set_delivery_policy)
+LOCKED_KEYWORDS(Video_device, Video_device_set_motion_detection)
+LOCKED_KEYWORDS(Video_device, Video_device_set_statistics)
+LOCKED_NOARGS(Video_device, Video_device_get_frame_info)
+LOCKED_VARARGS(Video_device, Video_device_set_frame_ring)
+LOCKED_KEYWORDS(Video_device, Video_device_set_realtime)
+LOCKED_KEYWORDS(Video_device, Video_device_get_latency)
+LOCKED_NOARGS(Video_device, Video_device_get_frame_counters)
+LOCKED_NOARGS(Video_device, Video_device_read)
+LOCKED_NOARGS(Video_device, Video_device_read_and_queue)
+LOCKED_KEYWORDS(Video_device, Video_device_wait_and_read)
+
+static PyMethodDef Video_device_methods[] = {
+  {"close", (PyCFunction)Video_device_close_locked, METH_NOARGS,
+       "close()\n\n"
+       "Close video device. Subsequent calls to other methods will fail."},
+  {"fileno", (PyCFunction)Video_device_fileno_locked, METH_NOARGS,
+       "fileno() -> integer \"file descriptor\".\n\n"
+       "This enables video devices to be passed select.select for waiting "
+       "until a frame is available for reading. Subscribed events are "
+       "signalled as an exceptional condition (POLLPRI), i.e. through the "
+       "third list passed to select.select."},
+  {"get_info", (PyCFunction)Video_device_get_info_locked, METH_NOARGS,
+       "get_info() -> driver, card, bus_info, capabilities\n\n"
+       "Returns three strings with information about the video device, and one "
+       "set containing strings identifying the capabilities of the video "
+       "device."},
+  {"subscribe_event", (PyCFunction)Video_device_subscribe_event_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "subscribe_event(type, id = 0, flags = 0)\n\n"
+       "Subscribe to events of the given type (EVENT_CTRL, "
+       "EVENT_SOURCE_CHANGE, EVENT_EOS, EVENT_FRAME_SYNC, ...). For "
+       "EVENT_CTRL, id is the control id (e.g. CID_EXPOSURE_ABSOLUTE). With "
+       "flags = EVENT_SUB_FL_SEND_INITIAL the current control value is "
+       "queued right away."},
+  {"unsubscribe_event", (PyCFunction)Video_device_unsubscribe_event_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "unsubscribe_event(type, id = 0)\n\n"
+       "Cancel a subscription made with 'subscribe_event'. EVENT_ALL cancels "
+       "all of them."},
+  {"dequeue_events", (PyCFunction)Video_device_dequeue_events_locked, METH_NOARGS,
+       "dequeue_events() -> list of (type, id, sequence, timestamp, data)\n\n"
+       "Return all pending events, or an empty list if there are none. data "
+       "is (changes, value) for EVENT_CTRL, changes for EVENT_SOURCE_CHANGE, "
+       "the frame sequence number for EVENT_FRAME_SYNC and None otherwise. "
+       "The timestamp is in seconds of CLOCK_MONOTONIC."},
+  {"get_fourcc", (PyCFunction)Video_device_get_fourcc, METH_VARARGS,
+       "get_fourcc(fourcc_string) -> fourcc_int\n\n"
+       "Return the fourcc string encoded as int."},
+  {"get_format", (PyCFunction)Video_device_get_format_locked, METH_NOARGS,
+       "get_format() -> size_x, size_y, fourcc\n\n"
+       "Request the current video format."},
+  {"set_format", (PyCFunction)Video_device_set_format_locked, METH_VARARGS|METH_KEYWORDS,
+       "set_format(size_x, size_y, yuv420 = 0, fourcc='MJPEG') -> size_x, size_y\n\n"
+       "Request the video device to set image size and format. The device may "
+       "choose another size than requested and will return its choice. The "
+       "image format will be RGB24 if yuv420 is zero (default) or YUV420 if "
+       "yuv420 is 1, if fourcc keyword is set that will be the fourcc pixel format used."},
+  {"set_fps", (PyCFunction)Video_device_set_fps_locked, METH_VARARGS,
+       "set_fps(fps) -> fps \n\n"
+       "Request the video device to set frame per seconds.The device may "
+       "choose another frame rate than requested and will return its choice. " },
+  {"set_auto_white_balance", (PyCFunction)Video_device_set_auto_white_balance_locked, METH_VARARGS,
+       "set_auto_white_balance(autowb) -> autowb \n\n"
+       "Request the video device to set auto white balance to value. The device may "
+       "choose another value than requested and will return its choice. " },
+  {"get_auto_white_balance", (PyCFunction)Video_device_get_auto_white_balance_locked, METH_NOARGS,
+       "get_auto_white_balance() -> autowb \n\n"
+       "Request the video device to get auto white balance value. " },
+  {"set_white_balance_temperature", (PyCFunction)Video_device_set_white_balance_temperature_locked, METH_VARARGS,
+       "set_white_balance_temperature(temp) -> temp \n\n"
+       "Request the video device to set white balance tempature to value. The device may "
+       "choose another value than requested and will return its choice. " },
+  {"get_white_balance_temperature", (PyCFunction)Video_device_get_white_balance_temperature_locked, METH_NOARGS,
+       "get_white_balance_temperature() -> temp \n\n"
+       "Request the video device to get white balance temperature value. " },
+  {"set_exposure_auto", (PyCFunction)Video_device_set_exposure_auto_locked, METH_VARARGS,
+       "set_exposure_auto(autoexp) -> autoexp \n\n"
+       "Request the video device to set auto exposure to value. The device may "
+       "choose another value than requested and will return its choice. " },
+  {"get_exposure_auto", (PyCFunction)Video_device_get_exposure_auto_locked, METH_NOARGS,
+       "get_exposure_auto() -> autoexp \n\n"
+       "Request the video device to get auto exposure value. " },
+  {"set_exposure_absolute", (PyCFunction)Video_device_set_exposure_absolute_locked, METH_VARARGS,
+       "set_exposure_absolute(exptime) -> exptime \n\n"
+       "Request the video device to set exposure time to value. The device may "
+       "choose another value than requested and will return its choice. " },
+  {"get_exposure_absolute", (PyCFunction)Video_device_get_exposure_absolute_locked, METH_NOARGS,
+       "get_exposure_absolute() -> exptime \n\n"
+       "Request the video device to get exposure time value. " },
+  {"set_focus_auto", (PyCFunction)Video_device_set_focus_auto_locked, METH_VARARGS,
+       "set_auto_focus_auto(autofocus) -> autofocus \n\n"
+       "Request the video device to set auto focuse on or off. The device may "
+       "choose another value than requested and will return its choice. " },
+  {"get_focus_auto", (PyCFunction)Video_device_get_focus_auto_locked, METH_NOARGS,
+       "get_focus_auto() -> autofocus \n\n"
+       "Request the video device to get auto focus value. " },
+  {"start", (PyCFunction)Video_device_start_locked, METH_NOARGS,
+       "start()\n\n"
+       "Start video capture."},
+  {"stop", (PyCFunction)Video_device_stop_locked, METH_NOARGS,
+       "stop()\n\n"
+       "Stop video capture."},
+  {"create_buffers", (PyCFunction)Video_device_create_buffers_locked, METH_VARARGS,
+       "create_buffers(count)\n\n"
+       "Create buffers used for capturing image data. Can only be called once "
+       "for each video device object."},
+  {"queue_all_buffers", (PyCFunction)Video_device_queue_all_buffers_locked,
+       METH_NOARGS,
+       "queue_all_buffers()\n\n"
+       "Let the video device fill all buffers created."},
+  {"export_buffers", (PyCFunction)Video_device_export_buffers_locked, METH_NOARGS,
+       "export_buffers() -> list of file descriptors\n\n"
+       "Export the buffers created by 'create_buffers' as DMABUF file "
+       "descriptors. The descriptors are owned by the video device and are "
+       "closed together with it. Note that the exported buffers hold the "
+       "image data in the device's native format, without libv4l "
+       "conversion."},
+  {"set_delivery_policy", (PyCFunction)Video_device_set_delivery_policy_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "set_delivery_policy(every = 1, fps = 0)\n\n"
+       "Only return every Nth frame, and/or frames at the given target rate "
+       "based on the capture timestamps. Useful when the device can't be set "
+       "to the wanted rate with 'set_fps'. The other frames are queued again "
+       "without being copied; use 'wait_and_read' to not be woken for "
+       "them. Call without arguments to return every frame "
+       "again."},
+  {"set_motion_detection", (PyCFunction)Video_device_set_motion_detection_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "set_motion_detection(threshold, decimation = 4, regions = None)\n\n"
+       "Drop frames that don't differ from the last frame returned. Every "
+       "decimation'th luma sample in both directions is compared, and a "
+       "frame is returned if the mean absolute difference in any of the "
+       "regions, given as (x, y, width, height) in pixels, exceeds "
+       "threshold (0-255). The whole frame is one region by default. "
+       "Dropped frames are queued again without being copied. Only works "
+       "with uncompressed formats; other frames are always returned. Call "
+       "with threshold 0 to return every frame again."},
+  {"set_statistics", (PyCFunction)Video_device_set_statistics_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "set_statistics(enable, grid_x = 4, grid_y = 4, percentile = 50)\n\n"
+       "Compute image statistics of every frame returned by 'read' and "
+       "'read_and_queue', for exposure and focus control. They are computed "
+       "on the luma of uncompressed formats and returned by "
+       "'get_frame_info'."},
+  {"get_frame_info", (PyCFunction)Video_device_get_frame_info_locked, METH_NOARGS,
+       "get_frame_info() -> dict\n\n"
+       "Return the buffer 'index', 'sequence' number, capture 'timestamp', "
+       "'bytesused' and 'flags' of the last frame returned. If statistics are "
+       "enabled, the dict also holds the luma 'histogram' (256 counts), the "
+       "'cell_mean' and 'cell_percentile' brightness of each grid cell as "
+       "grid_y lists of grid_x values, and the 'sharpness' (variance of the "
+       "Laplacian)."},
+  {"set_frame_ring", (PyCFunction)Video_device_set_frame_ring_locked, METH_VARARGS,
+       "set_frame_ring(ring)\n\n"
+       "Publish the frames read to the given Frame_ring, which must have been "
+       "created by this process, instead of returning them. 'read' and "
+       "'read_and_queue' then return the ring sequence number of the frame. "
+       "None returns frames to the caller again. Raises ValueError for a "
+       "ring this process has only attached to."},
+  {"set_realtime", (PyCFunction)Video_device_set_realtime_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "set_realtime(cpus = None, priority = 0, lock_memory = 0)\n\n"
+       "Tune the calling thread, which should be the one reading frames, for "
+       "low jitter: pin it to the given CPU numbers, and run it with "
+       "SCHED_FIFO at the given priority if it is above 0. With lock_memory "
+       "= 1, the capture buffers, the frame ring and the buffers used for "
+       "motion detection and statistics are locked into memory. The latter "
+       "are also allocated again as fresh pages that the calling thread "
+       "touches first, so that they end up on the memory node of its CPUs. "
+       "Memory stays locked until set_realtime is called with lock_memory = "
+       "0 or the device is closed. If any step fails, the earlier ones are "
+       "undone and IOError is raised. SCHED_FIFO and locking usually require "
+       "privileges or raised limits (RLIMIT_RTPRIO, RLIMIT_MEMLOCK)."},
+  {"get_latency", (PyCFunction)Video_device_get_latency_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "get_latency(reset = 0) -> dict\n\n"
+       "Return statistics of the time in seconds from the driver "
+       "timestamping a frame to it being dequeued: 'count', 'min', 'max', "
+       "'mean' and the standard deviation as 'jitter'. Frames without "
+       "monotonic timestamps aren't counted. With reset = 1, start over."},
+  {"get_frame_counters", (PyCFunction)Video_device_get_frame_counters_locked,
+       METH_NOARGS,
+       "get_frame_counters() -> dict\n\n"
+       "Return the number of frames that have been 'delivered' by 'read' and "
+       "'read_and_queue', of frames skipped by the delivery policy "
+       "('decimated') and of frames that were 'suppressed' by motion "
+       "detection."},
+  {"read", (PyCFunction)Video_device_read_locked, METH_NOARGS,
+       "read() -> string\n\n"
+       "Reads image data from a buffer that has been filled by the video "
+       "device. The image data is in RGB och YUV420 format as decided by "
+       "'set_format'. The buffer is removed from the queue. Fails if no buffer "
+       "is filled. Use select.select to check for filled buffers. Returns "
+       "None if all filled buffers were dropped by 'set_delivery_policy' or "
+       "'set_motion_detection'."},
+  {"read_and_queue", (PyCFunction)Video_device_read_and_queue_locked, METH_NOARGS,
+       "read_and_queue()\n\n"
+       "Same as 'read', but adds the buffer back to the queue so the video "
+       "device can fill it again."},
+  {"wait_and_read", (PyCFunction)Video_device_wait_and_read_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "wait_and_read(timeout = -1, queue = False) -> string\n\n"
+       "Wait for a frame that passes 'set_delivery_policy' and "
+       "'set_motion_detection' and return it like 'read', or like "
+       "'read_and_queue' if queue is true. Dropped frames are queued again "
+       "without returning to Python, and the GIL is released while waiting. "
+       "Returns None if no frame is returned within timeout seconds; a "
+       "negative timeout waits forever."},
+  {NULL}
+};
+
+static PyType_Slot Video_device_slots[] = {
+  {Py_tp_dealloc, Video_device_dealloc},
+  {Py_tp_init, Video_device_init},
+  {Py_tp_new, PyType_GenericNew},
+  {Py_tp_methods, Video_device_methods},
+  {Py_tp_doc, "Video_device(path)\n\nOpens the video device at the given "
+      "path and returns an object that can capture images. The constructor "
+      "and all methods except close may raise IOError."},
+  {0, NULL}
+};
+
+static PyType_Spec Video_device_spec = {
+  "v4l2capture.Video_device", sizeof(Video_device), 0, TYPE_FLAGS,
+  Video_device_slots
+};
+
+// Memory-to-memory devices (encoders, decoders, scalers) take frames on an
+// OUTPUT queue and return the processed result on a CAPTURE queue. Only the
+// single-planar API is supported.
+
+struct m2m_slot {
+  int queued;
+  Video_device *source;
+  int source_index;
+};
+
+typedef struct {
+  PyObject_HEAD
+  int fd;
+  enum v4l2_memory output_memory;
+  struct buffer *output_buffers;
+  struct m2m_slot *output_slots;
+  int output_buffer_count;
+  struct buffer *capture_buffers;
+  int capture_buffer_count;
+} M2M_device;
+
+static void M2M_device_release_source(M2M_device *self, struct m2m_slot *slot,
+    int requeue)
+{
+  // Give a capture buffer that was lent to the OUTPUT queue back to the video
+  // device it was dequeued from. The slot is detached before the source is
+  // locked; taking that lock may let another thread in to free the slots, so
+  // callers have to check output_slots again afterwards.
+
+  Video_device *source = slot->source;
+  int index = slot->source_index;
+
+  if(!source)
+    {
+      return;
+    }
+
+  slot->source = NULL;
+  Py_BEGIN_CRITICAL_SECTION2(self, source);
+
+  if(requeue && source->fd >= 0 && source->buffers)
+    {
+      struct v4l2_buffer buffer;
+      CLEAR(buffer);
+      buffer.index = index;
+      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buffer.memory = V4L2_MEMORY_MMAP;
+      xioctl(source->fd, VIDIOC_QBUF, &buffer);
+    }
+
+  Py_END_CRITICAL_SECTION2();
+  Py_DECREF(source);
+}
+
+static void M2M_device_free_buffers(M2M_device *self, int requeue)
+{
+  struct m2m_slot *slots = self->output_slots;
+  int i;
+
+  if(slots)
+    {
+      int count = self->output_buffer_count;
+      self->output_slots = NULL;
+
+      for(i = 0; i < count; i++)
+	{
+	  M2M_device_release_source(self, &slots[i], requeue);
+	}
+
+      free(slots);
+    }
+
+  // Nothing below can let another thread in, so the buffers are freed at
+  // most once even if that happened above.
+
+  if(self->output_buffers)
+    {
+      for(i = 0; i < self->output_buffer_count; i++)
+	{
+	  if(self->output_buffers[i].start)
+	    {
+	      v4l2_munmap(self->output_buffers[i].start,
+		  self->output_buffers[i].length);
+	    }
+	}
+
+      free(self->output_buffers);
+      self->output_buffers = NULL;
+    }
+
+  if(self->capture_buffers)
+    {
+      for(i = 0; i < self->capture_buffer_count; i++)
+	{
+	  if(self->capture_buffers[i].start)
+	    {
+	      v4l2_munmap(self->capture_buffers[i].start,
+		  self->capture_buffers[i].length);
+	    }
+	}
+
+      free(self->capture_buffers);
+      self->capture_buffers = NULL;
+    }
+
+  self->output_buffer_count = 0;
+  self->capture_buffer_count = 0;
+}
+
+static void M2M_device_dealloc(M2M_device *self)
+{
+  if(self->fd >= 0)
+    {
+      M2M_device_free_buffers(self, 0);
+      v4l2_close(self->fd);
+    }
+
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free((PyObject *)self);
+  Py_DECREF(type);
+}
+
+static int M2M_device_init(M2M_device *self, PyObject *args,
+    PyObject *kwargs)
+{
+  const char *device_path;
+  self->fd = -1;
+
+  if(!PyArg_ParseTuple(args, "s", &device_path))
+    {
+      return -1;
+    }
+
+  int fd = v4l2_open(device_path, O_RDWR | O_NONBLOCK);
+
+  if(fd < 0)
+    {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)device_path);
+      return -1;
+    }
+
+  struct v4l2_capability caps;
+
+  if(my_ioctl(fd, VIDIOC_QUERYCAP, &caps))
+    {
+      v4l2_close(fd);
+      return -1;
+    }
+
+  unsigned int device_caps = caps.capabilities & V4L2_CAP_DEVICE_CAPS ?
+    caps.device_caps : caps.capabilities;
+
+  if(!(device_caps & V4L2_CAP_VIDEO_M2M))
+    {
+      v4l2_close(fd);
+      PyErr_Format(PyExc_IOError, "%s is not a single-planar "
+	  "memory-to-memory device", device_path);
+      return -1;
+    }
+
+  self->fd = fd;
+  self->output_memory = V4L2_MEMORY_MMAP;
+  self->output_buffers = NULL;
+  self->output_slots = NULL;
+  self->output_buffer_count = 0;
+  self->capture_buffers = NULL;
+  self->capture_buffer_count = 0;
+  return 0;
+}
+
+static PyObject *M2M_device_close(M2M_device *self)
+{
+  if(self->fd >= 0)
+    {
+      M2M_device_free_buffers(self, 1);
+      v4l2_close(self->fd);
+      self->fd = -1;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *M2M_device_fileno(M2M_device *self)
+{
+  ASSERT_OPEN;
+  return PyLong_FromLong(self->fd);
+}
+
+static PyObject *M2M_device_get_info(M2M_device *self)
+{
+  ASSERT_OPEN;
+  return device_get_info(self->fd);
+}
+
+static PyObject *M2M_device_subscribe_event(M2M_device *self,
+    PyObject *args, PyObject *keywds)
+{
+  ASSERT_OPEN;
+  return device_subscribe_event(self->fd, args, keywds,
+      VIDIOC_SUBSCRIBE_EVENT);
+}
+
+static PyObject *M2M_device_unsubscribe_event(M2M_device *self,
+    PyObject *args, PyObject *keywds)
+{
+  ASSERT_OPEN;
+  return device_subscribe_event(self->fd, args, keywds,
+      VIDIOC_UNSUBSCRIBE_EVENT);
+}
+
+static PyObject *M2M_device_dequeue_events(M2M_device *self)
+{
+  ASSERT_OPEN;
+  return device_dequeue_events(self->fd);
+}
+
+static PyObject *M2M_device_set_format(M2M_device *self, PyObject *args)
+{
+  int size_x;
+  int size_y;
+  const char *output_fourcc;
+  Py_ssize_t output_fourcc_len;
+  const char *capture_fourcc;
+  Py_ssize_t capture_fourcc_len;
+
+  if(!PyArg_ParseTuple(args, "iis#s#", &size_x, &size_y, &output_fourcc,
+	  &output_fourcc_len, &capture_fourcc, &capture_fourcc_len))
+    {
+      return NULL;
+    }
+
+  ASSERT_OPEN;
+
+  if(output_fourcc_len != 4 || capture_fourcc_len != 4)
+    {
+      PyErr_SetString(PyExc_ValueError, "fourcc must be 4 characters");
+      return NULL;
+    }
+
+  struct v4l2_format format;
+  CLEAR(format);
+  format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+  if(my_ioctl(self->fd, VIDIOC_G_FMT, &format))
+    {
+      return NULL;
+    }
+
+  format.fmt.pix.pixelformat = v4l2_fourcc(output_fourcc[0],
+      output_fourcc[1], output_fourcc[2], output_fourcc[3]);
+  format.fmt.pix.width = size_x;
+  format.fmt.pix.height = size_y;
+  format.fmt.pix.field = V4L2_FIELD_ANY;
+  format.fmt.pix.bytesperline = 0;
+  format.fmt.pix.sizeimage = 0;
+
+  if(my_ioctl(self->fd, VIDIOC_S_FMT, &format))
+    {
+      return NULL;
+    }
+
+  size_x = format.fmt.pix.width;
+  size_y = format.fmt.pix.height;
+
+  CLEAR(format);
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  if(my_ioctl(self->fd, VIDIOC_G_FMT, &format))
+    {
+      return NULL;
+    }
+
+  format.fmt.pix.pixelformat = v4l2_fourcc(capture_fourcc[0],
+      capture_fourcc[1], capture_fourcc[2], capture_fourcc[3]);
+  format.fmt.pix.width = size_x;
+  format.fmt.pix.height = size_y;
+  format.fmt.pix.field = V4L2_FIELD_ANY;
+  format.fmt.pix.bytesperline = 0;
+  format.fmt.pix.sizeimage = 0;
+
+  if(my_ioctl(self->fd, VIDIOC_S_FMT, &format))
+    {
+      return NULL;
+    }
+
+  return Py_BuildValue("ii", size_x, size_y);
+}
+
+static void M2M_device_release_queue(M2M_device *self,
+    enum v4l2_buf_type type, enum v4l2_memory memory)
+{
+  // Give the buffers of a queue back to the driver after a failure, so
+  // that creating them can be retried. The error that is already set is
+  // the one reported.
+
+  struct v4l2_requestbuffers reqbuf;
+  CLEAR(reqbuf);
+  reqbuf.type = type;
+  reqbuf.memory = memory;
+  xioctl(self->fd, VIDIOC_REQBUFS, &reqbuf);
+}
+
+static int M2M_device_request_buffers(M2M_device *self, enum v4l2_buf_type type,
+    enum v4l2_memory memory, int count, struct buffer **buffers_out)
+{
+  // Request buffers on one of the two queues and map them unless they are
+  // going to be imported as DMABUF. On failure nothing is left mapped or
+  // allocated.
+
+  struct v4l2_requestbuffers reqbuf;
+  CLEAR(reqbuf);
+  reqbuf.count = count;
+  reqbuf.type = type;
+  reqbuf.memory = memory;
+
+  if(my_ioctl(self->fd, VIDIOC_REQBUFS, &reqbuf))
+    {
+      return -1;
+    }
+
+  if(!reqbuf.count)
+    {
+      PyErr_SetString(PyExc_IOError, "Not enough buffer memory");
+      return -1;
+    }
+
+  struct buffer *buffers = calloc(reqbuf.count, sizeof(struct buffer));
+
+  if(!buffers)
+    {
+      PyErr_NoMemory();
+      M2M_device_release_queue(self, type, memory);
+      return -1;
+    }
+
+  int i;
+
+  for(i = 0; i < reqbuf.count; i++)
+    {
+      buffers[i].dmabuf_fd = -1;
+
+      if(memory != V4L2_MEMORY_MMAP)
+	{
+	  continue;
+	}
+
+      struct v4l2_buffer buffer;
+      CLEAR(buffer);
+      buffer.index = i;
+      buffer.type = type;
+      buffer.memory = memory;
+
+      if(my_ioctl(self->fd, VIDIOC_QUERYBUF, &buffer))
+	{
+	  break;
+	}
+
+      void *start = v4l2_mmap(NULL, buffer.length, PROT_READ | PROT_WRITE,
+	  MAP_SHARED, self->fd, buffer.m.offset);
+
+      if(start == MAP_FAILED)
+	{
+	  PyErr_SetFromErrno(PyExc_IOError);
+	  break;
+	}
+
+      buffers[i].start = start;
+      buffers[i].length = buffer.length;
+    }
+
+  if(i < reqbuf.count)
+    {
+      while(i--)
+	{
+	  if(buffers[i].start)
+	    {
+	      v4l2_munmap(buffers[i].start, buffers[i].length);
+	    }
+	}
+
+      free(buffers);
+      M2M_device_release_queue(self, type, memory);
+      return -1;
+    }
+
+  *buffers_out = buffers;
+  return reqbuf.count;
+}
+
+static PyObject *M2M_device_create_buffers(M2M_device *self, PyObject *args,
+    PyObject *keywds)
+{
+  int output_count;
+  int capture_count;
+  int dmabuf = 0;
+  static char *kwlist [] = {
+    "output_count",
+    "capture_count",
+    "dmabuf",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "II|i", kwlist,
+	  &output_count, &capture_count, &dmabuf))
+    {
+      return NULL;
+    }
+
+  ASSERT_OPEN;
+
+  if(self->output_buffers || self->capture_buffers)
+    {
+      PyErr_SetString(PyExc_ValueError, "Buffers are already created");
+      return NULL;
+    }
+
+  self->output_memory = dmabuf ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+  int count = M2M_device_request_buffers(self, V4L2_BUF_TYPE_VIDEO_OUTPUT,
+      self->output_memory, output_count, &self->output_buffers);
+
+  if(count < 0)
+    {
+      return NULL;
+    }
+
+  self->output_buffer_count = count;
+  self->output_slots = calloc(count, sizeof(struct m2m_slot));
+
+  if(!self->output_slots)
+    {
+      PyErr_NoMemory();
+    }
+  else
+    {
+      count = M2M_device_request_buffers(self, V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	  V4L2_MEMORY_MMAP, capture_count, &self->capture_buffers);
+    }
+
+  if(!self->output_slots || count < 0)
+    {
+      M2M_device_free_buffers(self, 0);
+      M2M_device_release_queue(self, V4L2_BUF_TYPE_VIDEO_OUTPUT,
+	  self->output_memory);
+      return NULL;
+    }
+
+  self->capture_buffer_count = count;
+  Py_RETURN_NONE;
+}
+
+static PyObject *M2M_device_queue_all_buffers(M2M_device *self)
+{
+  if(!self->capture_buffers)
+    {
+      ASSERT_OPEN;
+      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
+      return NULL;
+    }
+
+  int i;
+
+  for(i = 0; i < self->capture_buffer_count; i++)
+    {
+      struct v4l2_buffer buffer;
+      CLEAR(buffer);
+      buffer.index = i;
+      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buffer.memory = V4L2_MEMORY_MMAP;
+
+      if(my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+	{
+	  return NULL;
+	}
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *M2M_device_start(M2M_device *self)
+{
+  ASSERT_OPEN;
+  enum v4l2_buf_type type;
+
+  type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+  if(my_ioctl(self->fd, VIDIOC_STREAMON, &type))
+    {
+      return NULL;
+    }
+
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  if(my_ioctl(self->fd, VIDIOC_STREAMON, &type))
+    {
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *M2M_device_stop(M2M_device *self)
+{
+  ASSERT_OPEN;
+  enum v4l2_buf_type type;
+
+  type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+  if(my_ioctl(self->fd, VIDIOC_STREAMOFF, &type))
+    {
+      return NULL;
+    }
+
+  // STREAMOFF returns every OUTPUT buffer to userspace, so the capture
+  // buffers they were borrowed from can go back to their devices.
+
+  int i;
+
+  for(i = 0; self->output_slots && i < self->output_buffer_count; i++)
+    {
+      self->output_slots[i].queued = 0;
+      M2M_device_release_source(self, &self->output_slots[i], 1);
+    }
+
+  ASSERT_OPEN;
+  type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  if(my_ioctl(self->fd, VIDIOC_STREAMOFF, &type))
+    {
+      return NULL;
+    }
+
+  Py_RETURN_NONE;
+}
+
+static int M2M_device_reclaim(M2M_device *self)
+{
+  // Dequeue every OUTPUT buffer the device has finished reading and return
+  // the index of a free one, or -1 if all of them are still queued.
+
+  for(;;)
+    {
+      struct v4l2_buffer buffer;
+      CLEAR(buffer);
+      buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+      buffer.memory = self->output_memory;
+
+      if(xioctl(self->fd, VIDIOC_DQBUF, &buffer))
+	{
+	  if(errno == EAGAIN)
+	    {
+	      break;
+	    }
+
+	  PyErr_SetFromErrno(PyExc_IOError);
+	  return -2;
+	}
+
+      self->output_slots[buffer.index].queued = 0;
+      M2M_device_release_source(self, &self->output_slots[buffer.index], 1);
+
+      if(self->fd < 0 || !self->output_slots)
+	{
+	  PyErr_SetString(PyExc_ValueError, "Device was closed while "
+	      "reclaiming buffers");
+	  return -2;
+	}
+    }
+
+  int i;
+
+  for(i = 0; i < self->output_buffer_count; i++)
+    {
+      if(!self->output_slots[i].queued)
+	{
+	  return i;
+	}
+    }
+
+  return -1;
+}
+
+static int M2M_device_get_free_slot(M2M_device *self, enum v4l2_memory memory)
+{
+  if(!self->output_buffers)
+    {
+      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
+      return -1;
+    }
+
+  if(self->output_memory != memory)
+    {
+      PyErr_SetString(PyExc_ValueError, memory == V4L2_MEMORY_DMABUF ?
+	  "Buffers were not created with dmabuf = 1" :
+	  "Buffers were created with dmabuf = 1");
+      return -1;
+    }
+
+  int index = M2M_device_reclaim(self);
+
+  if(index == -1)
+    {
+      errno = EAGAIN;
+      PyErr_SetFromErrno(PyExc_IOError);
+    }
+
+  return index < 0 ? -1 : index;
+}
+
+static PyObject *M2M_device_write(M2M_device *self, PyObject *args)
+{
+  const char *data;
+  Py_ssize_t length;
+  double timestamp = 0.0;
+
+  if(!PyArg_ParseTuple(args, "s#|d", &data, &length, &timestamp))
+    {
+      return NULL;
+    }
+
+  ASSERT_OPEN;
+  int index = M2M_device_get_free_slot(self, V4L2_MEMORY_MMAP);
+
+  if(index < 0)
+    {
+      return NULL;
+    }
+
+  if((size_t)length > self->output_buffers[index].length)
+    {
+      PyErr_SetString(PyExc_ValueError, "Frame does not fit in buffer");
+      return NULL;
+    }
+
+  memcpy(self->output_buffers[index].start, data, length);
+
+  struct v4l2_buffer buffer;
+  CLEAR(buffer);
+  buffer.index = index;
+  buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+  buffer.memory = V4L2_MEMORY_MMAP;
+  buffer.bytesused = length;
+  buffer.timestamp = double_to_timeval(timestamp);
+
+  if(my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+    {
+      return NULL;
+    }
+
+  self->output_slots[index].queued = 1;
+  Py_RETURN_NONE;
+}
+
+static PyObject *M2M_device_queue_from_source(M2M_device *self,
+    Video_device *source)
+{
+  ASSERT_OPEN;
+
+  // Finding a free slot may requeue buffers on other sources, which can let
+  // another thread in to close this one, so it is checked afterwards.
+
+  int index = M2M_device_get_free_slot(self, V4L2_MEMORY_DMABUF);
+
+  if(index < 0)
+    {
+      return NULL;
+    }
+
+  if(source->fd < 0 || !source->buffers)
+    {
+      PyErr_SetString(PyExc_ValueError, "Source has no buffers");
+      return NULL;
+    }
+
+  if(Video_device_export(source))
+    {
+      return NULL;
+    }
+
+  struct v4l2_buffer captured;
+  CLEAR(captured);
+  captured.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  captured.memory = V4L2_MEMORY_MMAP;
+
+  if(my_ioctl(source->fd, VIDIOC_DQBUF, &captured))
+    {
+      return NULL;
+    }
+
+  // Hand the captured buffer to the OUTPUT queue by DMABUF. The capture
+  // timestamp travels along and comes back on the encoded buffer.
+
+  struct v4l2_buffer buffer;
+  CLEAR(buffer);
+  buffer.index = index;
+  buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+  buffer.memory = V4L2_MEMORY_DMABUF;
+  buffer.m.fd = source->buffers[captured.index].dmabuf_fd;
+  buffer.length = source->buffers[captured.index].length;
+  buffer.bytesused = captured.bytesused;
+  buffer.timestamp = captured.timestamp;
+
+  if(my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+    {
+      xioctl(source->fd, VIDIOC_QBUF, &captured);
+      return NULL;
+    }
+
+  Py_INCREF(source);
+  self->output_slots[index].queued = 1;
+  self->output_slots[index].source = source;
+  self->output_slots[index].source_index = captured.index;
+  Py_RETURN_NONE;
+}
+
+static PyObject *M2M_device_queue_from(M2M_device *self, PyObject *args)
+{
+  module_state *state = PyType_GetModuleState(Py_TYPE(self));
+  Video_device *source;
+
+  if(!state || !PyArg_ParseTuple(args, "O!", state->Video_device_type,
+	  &source))
+    {
+      return NULL;
+    }
+
+  // Both devices' buffers are touched.
+
+  PyObject *result;
+  Py_BEGIN_CRITICAL_SECTION2(self, source);
+  result = M2M_device_queue_from_source(self, source);
+  Py_END_CRITICAL_SECTION2();
+  return result;
+}
+
+static PyObject *M2M_device_read_and_queue(M2M_device *self)
+{
+  if(!self->capture_buffers)
+    {
+      ASSERT_OPEN;
+      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
+      return NULL;
+    }
+
+  if(M2M_device_reclaim(self) == -2)
+    {
+      return NULL;
+    }
+
+  struct v4l2_buffer buffer;
+  CLEAR(buffer);
+  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer.memory = V4L2_MEMORY_MMAP;
+
+  if(my_ioctl(self->fd, VIDIOC_DQBUF, &buffer))
+    {
+      return NULL;
+    }
+
+  PyObject *data = PyBytes_FromStringAndSize(
+      self->capture_buffers[buffer.index].start, buffer.bytesused);
+
+  if(!data)
+    {
+      return NULL;
+    }
+
+  if(my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+    {
+      Py_DECREF(data);
+      return NULL;
+    }
+
+  return Py_BuildValue("Nd", data, timeval_to_double(&buffer.timestamp));
+}
+
+LOCKED_NOARGS(M2M_device, M2M_device_close)
+LOCKED_NOARGS(M2M_device, M2M_device_fileno)
+LOCKED_NOARGS(M2M_device, M2M_device_get_info)
+LOCKED_KEYWORDS(M2M_device, M2M_device_subscribe_event)
+LOCKED_KEYWORDS(M2M_device, M2M_device_unsubscribe_event)
+LOCKED_NOARGS(M2M_device, M2M_device_dequeue_events)
+LOCKED_VARARGS(M2M_device, M2M_device_set_format)
+LOCKED_KEYWORDS(M2M_device, M2M_device_create_buffers)
+LOCKED_NOARGS(M2M_device, M2M_device_queue_all_buffers)
+LOCKED_NOARGS(M2M_device, M2M_device_start)
+LOCKED_NOARGS(M2M_device, M2M_device_stop)
+LOCKED_VARARGS(M2M_device, M2M_device_write)
+LOCKED_NOARGS(M2M_device, M2M_device_read_and_queue)
+
+static PyMethodDef M2M_device_methods[] = {
+  {"close", (PyCFunction)M2M_device_close_locked, METH_NOARGS,
+       "close()\n\n"
+       "Close the device. Capture buffers borrowed from a Video_device by "
+       "'queue_from' are given back to it."},
+  {"fileno", (PyCFunction)M2M_device_fileno_locked, METH_NOARGS,
+       "fileno() -> integer \"file descriptor\".\n\n"
+       "This enables the device to be passed to select.select for waiting "
+       "until processed data is available for reading, or, through the "
+       "third list, until an event is pending."},
+  {"get_info", (PyCFunction)M2M_device_get_info_locked, METH_NOARGS,
+       "get_info() -> driver, card, bus_info, capabilities\n\n"
+       "Same as Video_device.get_info."},
+  {"subscribe_event", (PyCFunction)M2M_device_subscribe_event_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "subscribe_event(type, id = 0, flags = 0)\n\n"
+       "Same as Video_device.subscribe_event. Decoders report "
+       "EVENT_SOURCE_CHANGE and EVENT_EOS."},
+  {"unsubscribe_event", (PyCFunction)M2M_device_unsubscribe_event_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "unsubscribe_event(type, id = 0)\n\n"
+       "Same as Video_device.unsubscribe_event."},
+  {"dequeue_events", (PyCFunction)M2M_device_dequeue_events_locked, METH_NOARGS,
+       "dequeue_events() -> list of (type, id, sequence, timestamp, data)\n\n"
+       "Same as Video_device.dequeue_events."},
+  {"set_format", (PyCFunction)M2M_device_set_format_locked, METH_VARARGS,
+       "set_format(size_x, size_y, output_fourcc, capture_fourcc) -> "
+       "size_x, size_y\n\n"
+       "Set the format of the frames written to the device (e.g. 'YUYV' for "
+       "an encoder) and of the data read back from it (e.g. 'FWHT'). The "
+       "device may choose another size than requested and will return its "
+       "choice."},
+  {"create_buffers", (PyCFunction)M2M_device_create_buffers_locked,
+       METH_VARARGS|METH_KEYWORDS,
+       "create_buffers(output_count, capture_count, dmabuf = 0)\n\n"
+       "Create the buffers for both queues. If dmabuf is 1, frames are fed "
+       "with 'queue_from' instead of 'write'. Can only be called once."},
+  {"queue_all_buffers", (PyCFunction)M2M_device_queue_all_buffers_locked,
+       METH_NOARGS,
+       "queue_all_buffers()\n\n"
+       "Let the device fill all capture buffers created."},
+  {"start", (PyCFunction)M2M_device_start_locked, METH_NOARGS,
+       "start()\n\n"
+       "Start streaming on both queues."},
+  {"stop", (PyCFunction)M2M_device_stop_locked, METH_NOARGS,
+       "stop()\n\n"
+       "Stop streaming on both queues."},
+  {"write", (PyCFunction)M2M_device_write_locked, METH_VARARGS,
+       "write(data, timestamp = 0.0)\n\n"
+       "Copy a frame into a free output buffer and queue it for processing. "
+       "The timestamp is returned with the processed data. Raises IOError "
+       "with errno EAGAIN if the device has not finished with any of the "
+       "output buffers yet."},
+  {"queue_from", (PyCFunction)M2M_device_queue_from, METH_VARARGS,
+       "queue_from(video_device)\n\n"
+       "Dequeue a filled buffer from the given Video_device and queue it for "
+       "processing by DMABUF, without copying it. The buffer is given back "
+       "to the video device once processed. Requires dmabuf = 1 in "
+       "'create_buffers'; the video device must capture in a format the "
+       "device accepts, since libv4l conversion is bypassed."},
+  {"read_and_queue", (PyCFunction)M2M_device_read_and_queue_locked, METH_NOARGS,
+       "read_and_queue() -> data, timestamp\n\n"
+       "Read processed data from a filled capture buffer and add the buffer "
+       "back to the queue. The timestamp is the one of the frame the data "
+       "was produced from. Fails if no buffer is filled."},
+  {NULL}
+};
+
+static PyType_Slot M2M_device_slots[] = {
+  {Py_tp_dealloc, M2M_device_dealloc},
+  {Py_tp_init, M2M_device_init},
+  {Py_tp_new, PyType_GenericNew},
+  {Py_tp_methods, M2M_device_methods},
+  {Py_tp_doc, "M2M_device(path)\n\nOpens the memory-to-memory device "
+      "(hardware encoder, decoder or the vicodec test driver) at the given "
+      "path. The constructor and all methods except close may raise "
+      "IOError."},
+  {0, NULL}
+};
+
+static PyType_Spec M2M_device_spec = {
+  "v4l2capture.M2M_device", sizeof(M2M_device), 0, TYPE_FLAGS,
+  M2M_device_slots
+};
+
+static void Frame_ring_unmap(Frame_ring *self)
+{
+  if(self->map)
+    {
+      munmap(self->map, self->map_size);
+      self->map = NULL;
+    }
+
+  if(self->writer && self->name)
+    {
+      shm_unlink(self->name);
+    }
+
+  free(self->name);
+  self->name = NULL;
+}
+
+static void Frame_ring_dealloc(Frame_ring *self)
+{
+  Frame_ring_unmap(self);
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free((PyObject *)self);
+  Py_DECREF(type);
+}
+
+static int Frame_ring_init(Frame_ring *self, PyObject *args,
+    PyObject *kwargs)
+{
+  const char *name;
+  unsigned int slot_count = 0;
+  unsigned int slot_size = 0;
+  static char *kwlist [] = {
+    "name",
+    "slot_count",
+    "slot_size",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "s|II", kwlist, &name,
+	  &slot_count, &slot_size))
+    {
+      return -1;
+    }
+
+  if(self->map)
+    {
+      PyErr_SetString(PyExc_ValueError, "Ring is already open");
+      return -1;
+    }
+
+  int writer = slot_count > 0;
+
+  if(writer && !slot_size)
+    {
+      PyErr_SetString(PyExc_ValueError, "slot_size must be given");
+      return -1;
+    }
+
+  // slot_size is rounded up to the alignment below, which must not wrap.
+
+  if(slot_size > UINT_MAX - (FRAME_RING_ALIGN - 1))
+    {
+      PyErr_SetString(PyExc_ValueError, "slot_size is too large");
+      return -1;
+    }
+
+  int fd;
+
+  if(writer)
+    {
+      // Replace any ring left behind by a writer that died. Readers still
+      // attached to it keep their mapping.
+
+      shm_unlink(name);
+      fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+  else
+    {
+      fd = shm_open(name, O_RDWR, 0);
+    }
+
+  if(fd < 0)
+    {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)name);
+      return -1;
+    }
+
+  size_t map_size;
+
+  if(writer)
+    {
+      slot_size = (slot_size + FRAME_RING_ALIGN - 1) & ~(FRAME_RING_ALIGN - 1);
+      size_t data_offset = (sizeof(struct frame_ring_header) +
+	  slot_count * sizeof(struct frame_ring_slot) + FRAME_RING_ALIGN - 1) &
+	~(size_t)(FRAME_RING_ALIGN - 1);
+      map_size = data_offset + (size_t)slot_count * slot_size;
+
+      if(ftruncate(fd, map_size))
+	{
+	  PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)name);
+	  close(fd);
+	  shm_unlink(name);
+	  return -1;
+	}
+    }
+  else
+    {
+      struct stat st;
+
+      if(fstat(fd, &st))
+	{
+	  PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)name);
+	  close(fd);
+	  return -1;
+	}
+
+      map_size = st.st_size;
+    }
+
+  void *map = map_size < sizeof(struct frame_ring_header) ? MAP_FAILED :
+    mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+    {
+      if(map_size < sizeof(struct frame_ring_header))
+	{
+	  errno = EINVAL;
+	}
+
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)name);
+
+      if(writer)
+	{
+	  shm_unlink(name);
+	}
+
+      return -1;
+    }
+
+  struct frame_ring_header *header = map;
+
+  if(writer)
+    {
+      header->version = FRAME_RING_VERSION;
+      header->slot_count = slot_count;
+      header->slot_size = slot_size;
+      header->data_offset = (sizeof(struct frame_ring_header) +
+	  slot_count * sizeof(struct frame_ring_slot) + FRAME_RING_ALIGN - 1) &
+	~(size_t)(FRAME_RING_ALIGN - 1);
+      __atomic_store_n(&header->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+    }
+  else if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) !=
+      FRAME_RING_MAGIC || header->version != FRAME_RING_VERSION ||
+      !header->slot_count || !header->slot_size ||
+      header->data_offset < sizeof(struct frame_ring_header) +
+      (size_t)header->slot_count * sizeof(struct frame_ring_slot) ||
+      header->data_offset > map_size ||
+      (uint64_t)header->slot_count * header->slot_size >
+      map_size - header->data_offset)
+    {
+      munmap(map, map_size);
+      PyErr_Format(PyExc_IOError, "%s is not a frame ring", name);
+      return -1;
+    }
+
+  self->name = strdup(name);
+
+  if(!self->name)
+    {
+      munmap(map, map_size);
+
+      if(writer)
+	{
+	  shm_unlink(name);
+	}
+
+      PyErr_NoMemory();
+      return -1;
+    }
+
+  self->writer = writer;
+  self->map = map;
+  self->map_size = map_size;
+  self->header = header;
+  self->slots = (struct frame_ring_slot *)(header + 1);
+  self->data = (unsigned char *)map + header->data_offset;
+  self->next = __atomic_load_n(&header->write_sequence, __ATOMIC_ACQUIRE);
+  self->overruns = 0;
+  __atomic_store_n(&self->exports, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static PyObject *Frame_ring_close(Frame_ring *self)
+{
+  // Views may be released from any thread without the lock, so the count
+  // of exports is only ever updated atomically.
+
+  if(__atomic_load_n(&self->exports, __ATOMIC_ACQUIRE))
+    {
+      PyErr_SetString(PyExc_BufferError, "Ring is still in use");
+      return NULL;
+    }
+
+  Frame_ring_unmap(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject *Frame_ring_write(Frame_ring *self, PyObject *args,
+    PyObject *keywds)
+{
+  const char *data;
+  Py_ssize_t length;
+  double timestamp = 0;
+  unsigned long long frame_sequence = 0;
+  struct v4l2_pix_format format;
+  const char *fourcc = NULL;
+  Py_ssize_t fourcc_len = 0;
+  static char *kwlist [] = {
+    "data",
+    "timestamp",
+    "sequence",
+    "size_x",
+    "size_y",
+    "fourcc",
+    NULL
+  };
+
+  CLEAR(format);
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "s#|dKIIs#", kwlist, &data,
+	  &length, &timestamp, &frame_sequence, &format.width, &format.height,
+	  &fourcc, &fourcc_len))
+    {
+      return NULL;
+    }
+
+  if(fourcc_len == 4)
+    {
+      format.pixelformat = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2],
+	  fourcc[3]);
+    }
+
+  uint64_t ring_sequence;
+
+  if(frame_ring_publish(self, data, length, timestamp, frame_sequence,
+	  &format, &ring_sequence))
+    {
+      return NULL;
+    }
+
+  return PyLong_FromUnsignedLongLong(ring_sequence);
+}
+
+static PyObject *Frame_ring_read(Frame_ring *self, PyObject *args,
+    PyObject *keywds)
+{
+  int latest = 0;
+  static char *kwlist [] = {
+    "latest",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, keywds, "|i", kwlist, &latest))
+    {
+      return NULL;
+    }
+
+  if(!self->map)
+    {
+      PyErr_SetString(PyExc_ValueError, "I/O operation on closed ring");
+      return NULL;
+    }
+
+  struct frame_ring_header *header = self->header;
+  struct frame_ring_slot slot;
+  uint64_t n;
+  uint32_t index;
+
+  for(;;)
+    {
+      uint64_t written = __atomic_load_n(&header->write_sequence,
+	  __ATOMIC_ACQUIRE);
+
+      if(self->next >= written)
+	{
+	  Py_RETURN_NONE;
+	}
+
+      if(latest)
+	{
+	  self->next = written - 1;
+	}
+      else if(written - self->next > header->slot_count)
+	{
+	  // The writer has lapped us. Skip to the oldest frame still there.
+	  self->overruns += written - header->slot_count - self->next;
+	  self->next = written - header->slot_count;
+	}
+
+      n = self->next;
+      index = n % header->slot_count;
+      uint64_t sequence = __atomic_load_n(&self->slots[index].sequence,
+	  __ATOMIC_ACQUIRE);
+      slot = self->slots[index];
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+      if(sequence == 2 * n + 2 && __atomic_load_n(&self->slots[index].sequence,
+	      __ATOMIC_RELAXED) == sequence)
+	{
+	  break;
+	}
+
+      // Overwritten while we looked at it.
+      self->overruns++;
+      self->next++;
+    }
+
+  // Only move past the frame once it can be returned, so that a failure here
+  // does not lose it.
+
+  PyObject *ring_view = PyMemoryView_FromObject((PyObject *)self);
+
+  if(!ring_view)
+    {
+      return NULL;
+    }
+
+  Py_ssize_t start = header->data_offset + (size_t)index * header->slot_size;
+  PyObject *view = PySequence_GetSlice(ring_view, start,
+      start + slot.bytesused);
+  Py_DECREF(ring_view);
+
+  if(!view)
+    {
+      return NULL;
+    }
+
+  // The fourcc is bytes, since big-endian formats set the high bit.
+
+  char fourcc[5];
+  get_fourcc_str(fourcc, slot.pixelformat);
+  PyObject *result = Py_BuildValue("N{sKsKsdsIsIsIsy#}", view,
+      "ring_sequence", (unsigned long long)n,
+      "sequence", (unsigned long long)slot.frame_sequence,
+      "timestamp", slot.timestamp,
+      "bytesused", slot.bytesused,
+      "size_x", slot.width,
+      "size_y", slot.height,
+      "fourcc", fourcc, (Py_ssize_t)4);
+
+  if(result)
+    {
+      self->next = n + 1;
+    }
+
+  return result;
+}
+
+static PyObject *Frame_ring_is_valid(Frame_ring *self, PyObject *args)
+{
+  unsigned long long n;
+
+  if(!PyArg_ParseTuple(args, "K", &n))
+    {
+      return NULL;
+    }
+
+  if(!self->map)
+    {
+      PyErr_SetString(PyExc_ValueError, "I/O operation on closed ring");
+      return NULL;
+    }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  struct frame_ring_slot *slot = &self->slots[n % self->header->slot_count];
+  return PyBool_FromLong(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) ==
+      2 * n + 2);
+}
+
+static PyObject *Frame_ring_wait(Frame_ring *self, PyObject *args)
+{
+  double timeout = -1;
+
+  if(!PyArg_ParseTuple(args, "|d", &timeout))
+    {
+      return NULL;
+    }
+
+  if(!self->map)
+    {
+      PyErr_SetString(PyExc_ValueError, "I/O operation on closed ring");
+      return NULL;
+    }
+
+  struct frame_ring_header *header = self->header;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t)timeout;
+  deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000.0);
+
+  if(deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  // Keep close() from unmapping the ring while the lock is released.
+
+  int ready = 0;
+  __atomic_add_fetch(&self->exports, 1, __ATOMIC_ACQ_REL);
+
+  Py_BEGIN_ALLOW_THREADS
+  __atomic_add_fetch(&header->waiters, 1, __ATOMIC_ACQ_REL);
+
+  for(;;)
+    {
+      uint32_t futex = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+
+      if(__atomic_load_n(&header->write_sequence, __ATOMIC_ACQUIRE) >
+	  self->next)
+	{
+	  ready = 1;
+	  break;
+	}
+
+      struct timespec remaining;
+      struct timespec *remaining_p = NULL;
+
+      if(timeout >= 0)
+	{
+	  struct timespec now;
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+	  remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+
+	  if(remaining.tv_nsec < 0)
+	    {
+	      remaining.tv_sec--;
+	      remaining.tv_nsec += 1000000000;
+	    }
+
+	  if(remaining.tv_sec < 0)
+	    {
+	      break;
+	    }
+
+	  remaining_p = &remaining;
+	}
+
+      syscall(SYS_futex, &header->futex, FUTEX_WAIT, futex, remaining_p,
+	  NULL, 0);
+    }
+
+  __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_ACQ_REL);
+  Py_END_ALLOW_THREADS
+
+  __atomic_sub_fetch(&self->exports, 1, __ATOMIC_ACQ_REL);
+
+  return PyBool_FromLong(ready);
+}
+
+static PyObject *Frame_ring_get_overruns(Frame_ring *self)
+{
+  return PyLong_FromUnsignedLongLong(self->overruns);
+}
+
+static int Frame_ring_getbuffer(Frame_ring *self, Py_buffer *view, int flags)
+{
+  int result = -1;
+
+  // Locked so that close() can't unmap the ring between the check and
+  // counting the export. read() already holds the lock.
+
+  Py_BEGIN_CRITICAL_SECTION(self);
+
+  if(!self->map)
+    {
+      PyErr_SetString(PyExc_ValueError, "I/O operation on closed ring");
+      view->obj = NULL;
+    }
+
+  // Readers only get to see the ring; the writer fills it through write()
+  // or a Video_device.
+
+  else if(!PyBuffer_FillInfo(view, (PyObject *)self, self->map,
+	  self->map_size, 1, flags))
+    {
+      __atomic_add_fetch(&self->exports, 1, __ATOMIC_ACQ_REL);
+      result = 0;
+    }
+
+  Py_END_CRITICAL_SECTION();
+  return result;
+}
+
+static void Frame_ring_releasebuffer(Frame_ring *self, Py_buffer *view)
+{
+  __atomic_sub_fetch(&self->exports, 1, __ATOMIC_ACQ_REL);
+}
+
+LOCKED_NOARGS(Frame_ring, Frame_ring_close)
+LOCKED_KEYWORDS(Frame_ring, Frame_ring_write)
+LOCKED_KEYWORDS(Frame_ring, Frame_ring_read)
+LOCKED_VARARGS(Frame_ring, Frame_ring_is_valid)
+LOCKED_VARARGS(Frame_ring, Frame_ring_wait)
+LOCKED_NOARGS(Frame_ring, Frame_ring_get_overruns)
+
+static PyMethodDef Frame_ring_methods[] = {
+  {"close", (PyCFunction)Frame_ring_close_locked, METH_NOARGS,
+       "close()\n\n"
+       "Unmap the ring. The ring that created it also removes its name, so "
+       "no new readers can attach. Fails while frames returned by 'read' are "
+       "still referenced."},
+  {"write", (PyCFunction)Frame_ring_write_locked, METH_VARARGS|METH_KEYWORDS,
+       "write(data, timestamp = 0.0, sequence = 0, size_x = 0, size_y = 0, "
+       "fourcc = '') -> ring_sequence\n\n"
+       "Publish a frame. Only for rings created by this process. Frames from "
+       "a Video_device are published with Video_device.set_frame_ring."},
+  {"read", (PyCFunction)Frame_ring_read_locked, METH_VARARGS|METH_KEYWORDS,
+       "read(latest = 0) -> data, info\n\n"
+       "Return the next frame as a read-only memoryview into the shared "
+       "memory, and a dict with its 'ring_sequence', capture 'sequence', "
+       "'timestamp', 'bytesused', 'size_x', 'size_y' and 'fourcc' (as "
+       "bytes). Returns None if no new frame has been published. With "
+       "latest = 1, skip to the newest frame. Frames the writer has "
+       "overwritten before they were read are counted by 'get_overruns'. The "
+       "data is not copied, so the writer may overwrite it while it is being "
+       "used; check with 'is_valid' afterwards."},
+  {"is_valid", (PyCFunction)Frame_ring_is_valid_locked, METH_VARARGS,
+       "is_valid(ring_sequence) -> bool\n\n"
+       "Return whether the frame is still in the ring, i.e. whether a view "
+       "returned by 'read' for it held the frame until now."},
+  {"wait", (PyCFunction)Frame_ring_wait_locked, METH_VARARGS,
+       "wait(timeout = -1) -> bool\n\n"
+       "Wait until a frame is available for 'read', for at most timeout "
+       "seconds (forever if negative). Returns False on timeout."},
+  {"get_overruns", (PyCFunction)Frame_ring_get_overruns_locked, METH_NOARGS,
+       "get_overruns() -> integer\n\n"
+       "Return the number of frames this reader has missed because the "
+       "writer overwrote them first."},
+  {NULL}
+};
+
+static PyType_Slot Frame_ring_slots[] = {
+  {Py_tp_dealloc, Frame_ring_dealloc},
+  {Py_tp_init, Frame_ring_init},
+  {Py_tp_new, PyType_GenericNew},
+  {Py_tp_methods, Frame_ring_methods},
+  {Py_bf_getbuffer, Frame_ring_getbuffer},
+  {Py_bf_releasebuffer, Frame_ring_releasebuffer},
+  {Py_tp_doc, "Frame_ring(name, slot_count = 0, slot_size = 0)\n\nWith "
+      "slot_count and slot_size, create a ring of frames in POSIX shared "
+      "memory under the given name, replacing any existing one. Without "
+      "them, attach to the ring created by another process as a reader. Any "
+      "number of readers may attach; there is one writer."},
+  {0, NULL}
+};
+
+static PyType_Spec Frame_ring_spec = {
+  "v4l2capture.Frame_ring", sizeof(Frame_ring), 0, TYPE_FLAGS,
+  Frame_ring_slots
+};
+
+// A synchronizer matches frames from several video devices (stereo or
+// multi-view rigs) by their capture timestamps. It dequeues frames itself
+// and holds a small window of them per device until a set is complete.
+
+static void sync_stream_pop(struct sync_stream *stream)
+{
+  // Give the oldest held frame back to its device. The device must be
+  // locked, and the synchronizer too unless the stream was detached.
+
+  Video_device *device = stream->device;
+
+  if(device->fd >= 0 && device->buffers)
+    {
+      struct v4l2_buffer buffer;
+      CLEAR(buffer);
+      buffer.index = stream->frames[0].index;
+      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buffer.memory = V4L2_MEMORY_MMAP;
+      xioctl(device->fd, VIDIOC_QBUF, &buffer);
+    }
+
+  stream->count--;
+  memmove(stream->frames, stream->frames + 1,
+      stream->count * sizeof(struct held_frame));
+}
+
+// Working on a device's frames takes the device's lock while the
+// synchronizer's is held. Waiting for a contended lock suspends the ones
+// already held, so the synchronizer may have been closed or set up again
+// meanwhile. Both are locked together, and the generation, which changes
+// whenever the streams are replaced, is checked before using them again.
+
+static int Frame_synchronizer_check(Frame_synchronizer *self,
+    unsigned long generation)
+{
+  if(self->generation != generation)
+    {
+      PyErr_SetString(PyExc_ValueError, "Synchronizer was closed during "
+	  "read");
+      return -1;
+    }
+
+  return 0;
+}
+
+static int Frame_synchronizer_drop(Frame_synchronizer *self, int index,
+    unsigned long generation, int dropped)
+{
+  // Give the oldest held frame of a stream back, counting it as dropped if
+  // it wasn't part of a set.
+
+  Video_device *device = self->streams[index].device;
+  int result;
+  Py_INCREF(device);
+
+  Py_BEGIN_CRITICAL_SECTION2(self, device);
+  result = Frame_synchronizer_check(self, generation);
+
+  if(!result)
+    {
+      sync_stream_pop(&self->streams[index]);
+      self->streams[index].dropped += dropped;
+    }
+
+  Py_END_CRITICAL_SECTION2();
+
+  Py_DECREF(device);
+  return result ? result : Frame_synchronizer_check(self, generation);
+}
+
+static void Frame_synchronizer_release(Frame_synchronizer *self)
+{
+  // Detach the streams first, so that a read suspended on a device lock
+  // finds the synchronizer closed rather than freed memory.
+
+  struct sync_stream *streams = self->streams;
+  int stream_count = self->stream_count;
+  int i;
+
+  self->streams = NULL;
+  self->stream_count = 0;
+  self->generation++;
+
+  for(i = 0; i < stream_count; i++)
+    {
+      struct sync_stream *stream = &streams[i];
+
+      if(stream->device)
+	{
+	  Py_BEGIN_CRITICAL_SECTION(stream->device);
+
+	  while(stream->count)
+	    {
+	      sync_stream_pop(stream);
+	    }
+
+	  Py_END_CRITICAL_SECTION();
+	}
+
+      Py_CLEAR(stream->device);
+      free(stream->frames);
+    }
+
+  free(streams);
+}
+
+static void Frame_synchronizer_dealloc(Frame_synchronizer *self)
+{
+  Frame_synchronizer_release(self);
+  PyTypeObject *type = Py_TYPE(self);
+  type->tp_free((PyObject *)self);
+  Py_DECREF(type);
+}
+
+static int Frame_synchronizer_init(Frame_synchronizer *self, PyObject *args,
+    PyObject *kwargs)
+{
+  PyObject *devices;
+  double tolerance = 0.005;
+  int window = 2;
+  int clock = CLOCK_MONOTONIC;
+  static char *kwlist [] = {
+    "devices",
+    "tolerance",
+    "window",
+    "clock",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|dii", kwlist, &devices,
+	  &tolerance, &window, &clock))
+    {
+      return -1;
+    }
+
+  module_state *state = PyType_GetModuleState(Py_TYPE(self));
+
+  if(!state)
+    {
+      return -1;
+    }
+
+  if(window < 1 || tolerance < 0)
+    {
+      PyErr_SetString(PyExc_ValueError, "window must be at least 1 and "
+	  "tolerance must not be negative");
+      return -1;
+    }
+
+  if(clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME &&
+      clock != CLOCK_BOOTTIME)
+    {
+      PyErr_SetString(PyExc_ValueError, "clock must be CLOCK_MONOTONIC, "
+	  "CLOCK_REALTIME or CLOCK_BOOTTIME");
+      return -1;
+    }
+
+  PyObject *sequence = PySequence_Fast(devices,
+      "devices must be a sequence of Video_device");
+
+  if(!sequence)
+    {
+      return -1;
+    }
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(sequence);
+  Py_ssize_t i;
+
+  if(count < 2)
+    {
+      Py_DECREF(sequence);
+      PyErr_SetString(PyExc_ValueError, "At least two devices are needed");
+      return -1;
+    }
+
+  for(i = 0; i < count; i++)
+    {
+      if(!PyObject_TypeCheck(PySequence_Fast_GET_ITEM(sequence, i),
+	      state->Video_device_type))
+	{
+	  Py_DECREF(sequence);
+	  PyErr_SetString(PyExc_TypeError,
+	      "devices must be a sequence of Video_device");
+	  return -1;
+	}
+    }
+
+  Frame_synchronizer_release(self);
+  self->streams = calloc(count, sizeof(struct sync_stream));
+
+  if(!self->streams)
+    {
+      Py_DECREF(sequence);
+      PyErr_NoMemory();
+      return -1;
+    }
+
+  self->stream_count = count;
+
+  for(i = 0; i < count; i++)
+    {
+      struct sync_stream *stream = &self->streams[i];
+      stream->frames = malloc(window * sizeof(struct held_frame));
+
+      if(!stream->frames)
+	{
+	  Py_DECREF(sequence);
+	  PyErr_NoMemory();
+	  return -1;
+	}
+
+      stream->device = (Video_device *)PySequence_Fast_GET_ITEM(sequence, i);
+      Py_INCREF(stream->device);
+    }
+
+  Py_DECREF(sequence);
+  self->tolerance = tolerance;
+  self->window = window;
+  self->clock = clock;
+  self->timestamp_source = -1;
+  self->matched = 0;
+  return 0;
+}
+
+static double clock_offset(clockid_t clock)
+{
+  // Offset from CLOCK_MONOTONIC, which drivers timestamp buffers with, to
+  // the wanted clock. Sampled between two monotonic readings.
+
+  if(clock == CLOCK_MONOTONIC)
+    {
+      return 0;
+    }
+
+  struct timespec before;
+  struct timespec target;
+  struct timespec after;
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  clock_gettime(clock, &target);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  return target.tv_sec + target.tv_nsec / 1000000000.0 -
+    (before.tv_sec + after.tv_sec) / 2.0 -
+    (before.tv_nsec + after.tv_nsec) / 2000000000.0;
+}
+
+static int Frame_synchronizer_fill(Frame_synchronizer *self, int index,
+    double offset, unsigned long generation)
+{
+  // Dequeue every frame the device has ready. If the window is full, the
+  // oldest frame can't be part of a set any more and is dropped.
+
+  Video_device *device = self->streams[index].device;
+  int result;
+  Py_INCREF(device);
+
+  Py_BEGIN_CRITICAL_SECTION2(self, device);
+  result = Frame_synchronizer_check(self, generation);
+  struct sync_stream *stream = result ? NULL : &self->streams[index];
+
+  if(!result && (device->fd < 0 || !device->buffers))
+    {
+      PyErr_SetString(PyExc_ValueError, "Device is closed or has no buffers");
+      result = -1;
+    }
+  else if(!result && device->buffer_count <= self->window)
+    {
+      PyErr_SetString(PyExc_ValueError, "Devices need more buffers than "
+	  "the window");
+      result = -1;
+    }
+
+  while(!result)
+    {
+      struct v4l2_buffer buffer;
+      CLEAR(buffer);
+      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buffer.memory = V4L2_MEMORY_MMAP;
+
+      if(xioctl(device->fd, VIDIOC_DQBUF, &buffer))
+	{
+	  if(errno != EAGAIN)
+	    {
+	      PyErr_SetFromErrno(PyExc_IOError);
+	      result = -1;
+	    }
+
+	  break;
+	}
+
+      dequeue_latency_add(&device->latency, &buffer);
+
+      // Only monotonic timestamps can be compared across devices, and only
+      // if they are all taken at the start or all at the end of a frame.
+
+      uint32_t source = buffer.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK;
+
+      if((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+	  V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+	{
+	  PyErr_SetString(PyExc_ValueError, "Device does not timestamp "
+	      "buffers with CLOCK_MONOTONIC");
+	  result = -1;
+	}
+      else if(self->timestamp_source >= 0 &&
+	  (uint32_t)self->timestamp_source != source)
+	{
+	  PyErr_SetString(PyExc_ValueError, "Devices timestamp buffers at "
+	      "different points of the frame");
+	  result = -1;
+	}
+
+      if(result)
+	{
+	  xioctl(device->fd, VIDIOC_QBUF, &buffer);
+	  break;
+	}
+
+      self->timestamp_source = source;
+
+      if(stream->count == self->window)
+	{
+	  sync_stream_pop(stream);
+	  stream->dropped++;
+	}
+
+      struct held_frame *frame = &stream->frames[stream->count++];
+      frame->index = buffer.index;
+      frame->bytesused = buffer.bytesused;
+      frame->sequence = buffer.sequence;
+      frame->timestamp = timeval_to_double(&buffer.timestamp) + offset;
+    }
+
+  Py_END_CRITICAL_SECTION2();
+
+  Py_DECREF(device);
+  return result ? result : Frame_synchronizer_check(self, generation);
+}
+
+static PyObject *Frame_synchronizer_emit(Frame_synchronizer *self,
+    unsigned long generation)
+{
+  // Copy out the head frame of every stream as one set and requeue them.
+
+  int stream_count = self->stream_count;
+  PyObject *frames = PyTuple_New(stream_count);
+  PyObject *timestamps = PyTuple_New(stream_count);
+  PyObject *sequences = PyTuple_New(stream_count);
+  int i;
+
+  for(i = 0; frames && timestamps && sequences && i < stream_count; i++)
+    {
+      Video_device *device = self->streams[i].device;
+      struct held_frame frame;
+      PyObject *data = NULL;
+      int failed;
+      Py_INCREF(device);
+
+      // The device's lock keeps it from being closed during the copy.
+
+      Py_BEGIN_CRITICAL_SECTION2(self, device);
+      failed = Frame_synchronizer_check(self, generation);
+
+      if(!failed && (device->fd < 0 || !device->buffers))
+	{
+	  PyErr_SetString(PyExc_ValueError, "Device is closed or has no "
+	      "buffers");
+	}
+      else if(!failed)
+	{
+	  frame = self->streams[i].frames[0];
+	  data = PyBytes_FromStringAndSize(device->buffers[frame.index].start,
+	      frame.bytesused);
+	}
+
+      Py_END_CRITICAL_SECTION2();
+      Py_DECREF(device);
+
+      if(data && Frame_synchronizer_check(self, generation))
+	{
+	  Py_CLEAR(data);
+	}
+
+      PyObject *timestamp = data ? PyFloat_FromDouble(frame.timestamp) :
+	NULL;
+      PyObject *sequence = timestamp ?
+	PyLong_FromUnsignedLong(frame.sequence) : NULL;
+
+      if(!data || !timestamp || !sequence)
+	{
+	  Py_XDECREF(data);
+	  Py_XDECREF(timestamp);
+	  Py_XDECREF(sequence);
+	  Py_CLEAR(frames);
+	  break;
+	}
+
+      PyTuple_SET_ITEM(frames, i, data);
+      PyTuple_SET_ITEM(timestamps, i, timestamp);
+      PyTuple_SET_ITEM(sequences, i, sequence);
+    }
+
+  // Requeue the set, unless the synchronizer was closed and did so itself.
+
+  for(i = 0; self->generation == generation && i < stream_count; i++)
+    {
+      if(Frame_synchronizer_drop(self, i, generation, 0))
+	{
+	  Py_CLEAR(frames);
+	}
+    }
+
+  if(!frames || !timestamps || !sequences)
+    {
+      Py_XDECREF(frames);
+      Py_XDECREF(timestamps);
+      Py_XDECREF(sequences);
+      return NULL;
+    }
+
+  self->matched++;
+  return Py_BuildValue("NNN", frames, timestamps, sequences);
+}
+
+static PyObject *Frame_synchronizer_read(Frame_synchronizer *self)
+{
+  if(!self->streams)
+    {
+      PyErr_SetString(PyExc_ValueError, "I/O operation on closed "
+	  "synchronizer");
+      return NULL;
+    }
+
+  unsigned long generation = self->generation;
+  double offset = clock_offset(self->clock);
+  int i;
+
+  for(i = 0; i < self->stream_count; i++)
+    {
+      if(Frame_synchronizer_fill(self, i, offset, generation))
+	{
+	  return NULL;
+	}
+    }
+
+  // Look at the oldest frame of every device. If they are all within the
+  // tolerance they form a set. Otherwise the oldest of them is earlier
+  // than anything the other devices still have, so it can never be
+  // matched and is dropped.
+
+  for(;;)
+    {
+      int oldest = -1;
+      double first = 0;
+      double last = 0;
+
+      for(i = 0; i < self->stream_count; i++)
+	{
+	  struct sync_stream *stream = &self->streams[i];
+
+	  if(!stream->count)
+	    {
+	      Py_RETURN_NONE;
+	    }
+
+	  double timestamp = stream->frames[0].timestamp;
+
+	  if(oldest < 0 || timestamp < first)
+	    {
+	      oldest = i;
+	      first = timestamp;
+	    }
+
+	  if(!i || timestamp > last)
+	    {
+	      last = timestamp;
+	    }
+	}
+
+      if(last - first <= self->tolerance)
+	{
+	  return Frame_synchronizer_emit(self, generation);
+	}
+
+      if(Frame_synchronizer_drop(self, oldest, generation, 1))
+	{
+	  return NULL;
+	}
+    }
+}
+
+static PyObject *Frame_synchronizer_get_counters(Frame_synchronizer *self)
+{
+  PyObject *dropped = PyTuple_New(self->stream_count);
+
+  if(!dropped)
+    {
+      return NULL;
+    }
+
+  int i;
+
+  for(i = 0; i < self->stream_count; i++)
+    {
+      PyObject *count = PyLong_FromUnsignedLongLong(
+	  self->streams[i].dropped);
+
+      if(!count)
+	{
+	  Py_DECREF(dropped);
+	  return NULL;
+	}
+
+      PyTuple_SET_ITEM(dropped, i, count);
+    }
+
+  return Py_BuildValue("{sKsN}", "matched", self->matched, "dropped",
+      dropped);
+}
+
+static PyObject *Frame_synchronizer_close(Frame_synchronizer *self)
+{
+  Frame_synchronizer_release(self);
+  Py_RETURN_NONE;
+}
+
+LOCKED_NOARGS(Frame_synchronizer, Frame_synchronizer_close)
+LOCKED_NOARGS(Frame_synchronizer, Frame_synchronizer_read)
+LOCKED_NOARGS(Frame_synchronizer, Frame_synchronizer_get_counters)
+
+static PyMethodDef Frame_synchronizer_methods[] = {
+  {"close", (PyCFunction)Frame_synchronizer_close_locked, METH_NOARGS,
+       "close()\n\n"
+       "Give all held frames back to their devices and let go of the "
+       "devices."},
+  {"read", (PyCFunction)Frame_synchronizer_read_locked, METH_NOARGS,
+       "read() -> frames, timestamps, sequences\n\n"
+       "Dequeue the frames that are ready on all devices and return the "
+       "oldest complete set: a tuple with the image data of every device, "
+       "one with their capture timestamps in seconds of the chosen clock, "
+       "and one with their sequence numbers. Returns None if no set is "
+       "complete. Call it until it returns None whenever select.select "
+       "reports any of the devices readable, as frames already held by the "
+       "synchronizer don't make devices readable again."},
+  {"get_counters", (PyCFunction)Frame_synchronizer_get_counters_locked,
+       METH_NOARGS,
+       "get_counters() -> dict\n\n"
+       "Return the number of sets 'matched', and a tuple with the number of "
+       "frames 'dropped' from each device because they had no match."},
+  {NULL}
+};
+
+static PyType_Slot Frame_synchronizer_slots[] = {
+  {Py_tp_dealloc, Frame_synchronizer_dealloc},
+  {Py_tp_init, Frame_synchronizer_init},
+  {Py_tp_new, PyType_GenericNew},
+  {Py_tp_methods, Frame_synchronizer_methods},
+  {Py_tp_doc, "Frame_synchronizer(devices, tolerance = 0.005, window = 2, "
+      "clock = CLOCK_MONOTONIC)\n\nMatch the frames of two or more "
+      "started Video_device objects whose capture timestamps lie within "
+      "tolerance seconds of each other. Up to window frames are held per "
+      "device while waiting for a match, so every device needs more "
+      "buffers than that. Timestamps are converted from the drivers' "
+      "CLOCK_MONOTONIC to clock (CLOCK_MONOTONIC, CLOCK_REALTIME or "
+      "CLOCK_BOOTTIME); devices with other timestamps, or that disagree on "
+      "whether frames are timestamped at their start or end, make read "
+      "raise ValueError. Frames taken by the synchronizer bypass the "
+      "devices' delivery policy, motion detection, statistics and frame "
+      "ring."},
+  {0, NULL}
+};
+
+static PyType_Spec Frame_synchronizer_spec = {
+  "v4l2capture.Frame_synchronizer", sizeof(Frame_synchronizer), 0,
+  TYPE_FLAGS, Frame_synchronizer_slots
+};
+
+// Discovery probes every video node on a thread of its own, so that a
+// driver that blocks in open or an ioctl only costs its own timeout. A
+// probe that times out is abandoned: its thread keeps running until the
+// driver returns and then just drops its reference to the shared state.
+// Until then, its node is not probed again.
+
+#define DISCOVERY_MAX_FORMATS 64
+
+struct discovered_format {
+  uint32_t type;
+  uint32_t pixelformat;
+  char description[32];
+};
+
+enum {
+  PROBE_PENDING,
+  PROBE_RUNNING,
+  PROBE_DONE,
+  PROBE_TIMED_OUT,
+  PROBE_STUCK
+};
+
+struct probe {
+  char path[sizeof("/dev/") + NAME_MAX];
+  int state;
+  int error;
+  struct timespec deadline;
+  struct v4l2_capability caps;
+  int format_count;
+  struct discovered_format formats[DISCOVERY_MAX_FORMATS];
+};
+
+struct discovery {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int references;
+  int running;
+  int use_libv4l;
+  int probe_count;
+  struct probe probes[];
+};
+
+struct probe_job {
+  struct discovery *discovery;
+  struct probe *probe;
+};
+
+// Nodes whose abandoned probe thread hasn't returned yet, so that a hung
+// driver doesn't collect another thread on every call. This is process wide
+// since the threads can outlive the module.
+
+struct stuck_probe {
+  struct stuck_probe *next;
+  char path[sizeof("/dev/") + NAME_MAX];
+};
+
+static pthread_mutex_t stuck_probes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stuck_probe *stuck_probes;
+
+static int probe_is_stuck(const char *path)
+{
+  pthread_mutex_lock(&stuck_probes_lock);
+  struct stuck_probe *stuck = stuck_probes;
+
+  while(stuck && strcmp(stuck->path, path))
+    {
+      stuck = stuck->next;
+    }
+
+  pthread_mutex_unlock(&stuck_probes_lock);
+  return stuck != NULL;
+}
+
+static void probe_set_stuck(const char *path, int stuck)
+{
+  pthread_mutex_lock(&stuck_probes_lock);
+
+  if(stuck)
+    {
+      // Without memory the node is just probed again next time.
+
+      struct stuck_probe *entry = malloc(sizeof(*entry));
+
+      if(entry)
+	{
+	  snprintf(entry->path, sizeof(entry->path), "%s", path);
+	  entry->next = stuck_probes;
+	  stuck_probes = entry;
+	}
+    }
+  else
+    {
+      struct stuck_probe **link = &stuck_probes;
+
+      while(*link && strcmp((*link)->path, path))
+	{
+	  link = &(*link)->next;
+	}
+
+      if(*link)
+	{
+	  struct stuck_probe *entry = *link;
+	  *link = entry->next;
+	  free(entry);
+	}
+    }
+
+  pthread_mutex_unlock(&stuck_probes_lock);
+}
+
+static struct {
+  uint32_t type;
+  const char *name;
+} buffer_types[] = {
+  { V4L2_BUF_TYPE_VIDEO_CAPTURE, "capture" },
+  { V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, "capture_mplane" },
+  { V4L2_BUF_TYPE_VIDEO_OUTPUT, "output" },
+  { V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, "output_mplane" }
+};
+
+static void discovery_release(struct discovery *discovery)
 {
-#ifdef V4L2_CID_WHITE_BALANCE_TEMPERATURE
-  int wb;
-  if(!PyArg_ParseTuple(args, "i", &wb))
+  // Called with the lock held. Frees the state with the last reference.
+
+  if(--discovery->references)
     {
-      return NULL;
+      pthread_mutex_unlock(&discovery->lock);
+      return;
     }
 
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_WHITE_BALANCE_TEMPERATURE;
-  ctrl.value = wb;
-  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
+  pthread_mutex_unlock(&discovery->lock);
+  pthread_mutex_destroy(&discovery->lock);
+  pthread_cond_destroy(&discovery->done);
+  free(discovery);
 }
 
-static PyObject *Video_device_get_white_balance_temperature(Video_device *self)
+static int probe_ioctl(int use_libv4l, int fd, unsigned long request,
+    void *arg)
 {
-#ifdef V4L2_CID_WHITE_BALANCE_TEMPERATURE
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_WHITE_BALANCE_TEMPERATURE;
-  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
-}
+  int result;
 
-static PyObject *Video_device_set_exposure_absolute(Video_device *self, PyObject *args)
-{
-#ifdef V4L2_CID_EXPOSURE_ABSOLUTE
-  int exposure;
-  if(!PyArg_ParseTuple(args, "i", &exposure))
+  do
     {
-      return NULL;
+      result = use_libv4l ? v4l2_ioctl(fd, request, arg) :
+	ioctl(fd, request, arg);
     }
+  while(result && errno == EINTR);
 
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_EXPOSURE_ABSOLUTE;
-  ctrl.value = exposure;
-  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
+  return result;
 }
 
-static PyObject *Video_device_get_exposure_absolute(Video_device *self)
+static void probe_device(struct probe *probe, int use_libv4l)
 {
-#ifdef V4L2_CID_EXPOSURE_ABSOLUTE
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_EXPOSURE_ABSOLUTE;
-  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
-}
+  // Fills in a private copy first, as the caller may read the probe as
+  // soon as it isn't running any more.
 
-static PyObject *Video_device_set_exposure_auto(Video_device *self, PyObject *args)
-{
-#ifdef V4L2_CID_EXPOSURE_AUTO
-  int autoexposure;
-  if(!PyArg_ParseTuple(args, "i", &autoexposure))
+  struct v4l2_capability caps;
+  struct discovered_format formats[DISCOVERY_MAX_FORMATS];
+  int format_count = 0;
+  int error = 0;
+  int fd = use_libv4l ? v4l2_open(probe->path, O_RDWR | O_NONBLOCK) :
+    open(probe->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+  if(fd < 0)
     {
-      return NULL;
+      probe->error = errno;
+      return;
     }
 
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_EXPOSURE_AUTO;
-  ctrl.value = autoexposure;
-  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
-}
+  CLEAR(caps);
 
-static PyObject *Video_device_get_exposure_auto(Video_device *self)
-{
-#ifdef V4L2_CID_EXPOSURE_AUTO
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_EXPOSURE_AUTO;
-  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
+  if(probe_ioctl(use_libv4l, fd, VIDIOC_QUERYCAP, &caps))
+    {
+      error = errno;
+    }
+  else
+    {
+      uint32_t device_caps = caps.capabilities & V4L2_CAP_DEVICE_CAPS ?
+	caps.device_caps : caps.capabilities;
+      size_t i;
+
+      if(device_caps & V4L2_CAP_VIDEO_M2M)
+	{
+	  device_caps |= V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_OUTPUT;
+	}
+
+      if(device_caps & V4L2_CAP_VIDEO_M2M_MPLANE)
+	{
+	  device_caps |= V4L2_CAP_VIDEO_CAPTURE_MPLANE |
+	    V4L2_CAP_VIDEO_OUTPUT_MPLANE;
+	}
+
+      for(i = 0; i < sizeof(buffer_types) / sizeof(buffer_types[0]); i++)
+	{
+	  uint32_t type = buffer_types[i].type;
+	  uint32_t cap = type == V4L2_BUF_TYPE_VIDEO_CAPTURE ?
+	    V4L2_CAP_VIDEO_CAPTURE :
+	    type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ?
+	    V4L2_CAP_VIDEO_CAPTURE_MPLANE :
+	    type == V4L2_BUF_TYPE_VIDEO_OUTPUT ? V4L2_CAP_VIDEO_OUTPUT :
+	    V4L2_CAP_VIDEO_OUTPUT_MPLANE;
+	  struct v4l2_fmtdesc description;
+	  CLEAR(description);
+	  description.type = type;
+
+	  if(!(device_caps & cap))
+	    {
+	      continue;
+	    }
+
+	  while(format_count < DISCOVERY_MAX_FORMATS &&
+	      !probe_ioctl(use_libv4l, fd, VIDIOC_ENUM_FMT, &description))
+	    {
+	      struct discovered_format *format = &formats[format_count++];
+	      format->type = type;
+	      format->pixelformat = description.pixelformat;
+	      memcpy(format->description, description.description,
+		  sizeof(format->description));
+	      format->description[sizeof(format->description) - 1] = 0;
+	      description.index++;
+	    }
+	}
+    }
+
+  if(use_libv4l)
+    {
+      v4l2_close(fd);
+    }
+  else
+    {
+      close(fd);
+    }
+
+  probe->caps = caps;
+  memcpy(probe->formats, formats, format_count * sizeof(formats[0]));
+  probe->format_count = format_count;
+  probe->error = error;
 }
 
-static PyObject *Video_device_set_focus_auto(Video_device *self, PyObject *args)
+static void *probe_thread(void *arg)
 {
-#ifdef V4L2_CID_FOCUS_AUTO
-  int autofocus;
-  if(!PyArg_ParseTuple(args, "i", &autofocus))
+  struct probe_job *job = arg;
+  struct discovery *discovery = job->discovery;
+  struct probe *probe = job->probe;
+  free(job);
+
+  // The probe belongs to this thread until it is marked done or timed out,
+  // so it can be written without the lock. A timed out probe is never
+  // read again.
+
+  probe_device(probe, discovery->use_libv4l);
+  pthread_mutex_lock(&discovery->lock);
+
+  if(probe->state == PROBE_RUNNING)
     {
-      return NULL;
+      probe->state = PROBE_DONE;
+      discovery->running--;
+      pthread_cond_signal(&discovery->done);
+    }
+  else if(probe->state == PROBE_TIMED_OUT)
+    {
+      probe_set_stuck(probe->path, 0);
     }
 
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_FOCUS_AUTO;
-  ctrl.value = autofocus;
-  if(my_ioctl(self->fd, VIDIOC_S_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
+  discovery_release(discovery);
   return NULL;
-#endif
 }
 
-static PyObject *Video_device_get_focus_auto(Video_device *self)
+static int timespec_before(const struct timespec *a, const struct timespec *b)
 {
-#ifdef V4L2_CID_FOCUS_AUTO
-  struct v4l2_control ctrl;
-  CLEAR(ctrl);
-  ctrl.id    = V4L2_CID_FOCUS_AUTO;
-  if(my_ioctl(self->fd, VIDIOC_G_CTRL, &ctrl)){
-  	return NULL;
-  }
-  return Py_BuildValue("i",ctrl.value);
-#else
-  return NULL;
-#endif
+  return a->tv_sec < b->tv_sec ||
+    (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
 }
 
-static PyObject *Video_device_start(Video_device *self)
+static void discovery_run(struct discovery *discovery, double timeout,
+    int max_workers)
 {
-  ASSERT_OPEN;
-  enum v4l2_buf_type type;
-  type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  // Keeps up to max_workers probes running and gives up on each one that
+  // doesn't finish within timeout seconds. Called without the GIL.
 
-  if(my_ioctl(self->fd, VIDIOC_STREAMON, &type))
+  int next = 0;
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  pthread_mutex_lock(&discovery->lock);
+
+  for(;;)
     {
-      return NULL;
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      while(discovery->running < max_workers &&
+	  next < discovery->probe_count)
+	{
+	  struct probe *probe = &discovery->probes[next++];
+
+	  if(probe->state != PROBE_PENDING)
+	    {
+	      continue;
+	    }
+
+	  struct probe_job *job = malloc(sizeof(*job));
+	  pthread_t thread;
+
+	  if(!job)
+	    {
+	      probe->error = ENOMEM;
+	      probe->state = PROBE_DONE;
+	      continue;
+	    }
+
+	  job->discovery = discovery;
+	  job->probe = probe;
+	  probe->state = PROBE_RUNNING;
+	  probe->deadline.tv_sec = now.tv_sec + (time_t)timeout;
+	  probe->deadline.tv_nsec = now.tv_nsec +
+	    (long)((timeout - (time_t)timeout) * 1000000000);
+
+	  if(probe->deadline.tv_nsec >= 1000000000)
+	    {
+	      probe->deadline.tv_sec++;
+	      probe->deadline.tv_nsec -= 1000000000;
+	    }
+
+	  int error = pthread_create(&thread, &attributes, probe_thread, job);
+
+	  if(error)
+	    {
+	      free(job);
+	      probe->error = error;
+	      probe->state = PROBE_DONE;
+	      continue;
+	    }
+
+	  discovery->references++;
+	  discovery->running++;
+	}
+
+      if(!discovery->running)
+	{
+	  break;
+	}
+
+      // Abandon the probes that are past their deadline and wait for the
+      // next deadline or a finished probe.
+
+      struct timespec *deadline = NULL;
+      int i;
+
+      for(i = 0; i < next; i++)
+	{
+	  struct probe *probe = &discovery->probes[i];
+
+	  if(probe->state != PROBE_RUNNING)
+	    {
+	      continue;
+	    }
+
+	  if(!timespec_before(&now, &probe->deadline))
+	    {
+	      probe->state = PROBE_TIMED_OUT;
+	      probe_set_stuck(probe->path, 1);
+	      discovery->running--;
+	    }
+	  else if(!deadline || timespec_before(&probe->deadline, deadline))
+	    {
+	      deadline = &probe->deadline;
+	    }
+	}
+
+      if(deadline)
+	{
+	  struct timespec until = *deadline;
+	  pthread_cond_timedwait(&discovery->done, &discovery->lock, &until);
+	}
     }
 
-  Py_RETURN_NONE;
+  pthread_mutex_unlock(&discovery->lock);
+  pthread_attr_destroy(&attributes);
 }
 
-static PyObject *Video_device_stop(Video_device *self)
+static PyObject *probe_to_record(struct probe *probe, const char *key)
 {
-  ASSERT_OPEN;
-  enum v4l2_buf_type type;
-  type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if(probe->state == PROBE_TIMED_OUT)
+    {
+      return Py_BuildValue("{sssssz}", "path", probe->path, "key", key,
+	  "error", "Timed out");
+    }
 
-  if(my_ioctl(self->fd, VIDIOC_STREAMOFF, &type))
+  if(probe->state == PROBE_STUCK)
+    {
+      return Py_BuildValue("{sssssz}", "path", probe->path, "key", key,
+	  "error", "Timed out earlier and still not responding");
+    }
+
+  if(probe->error)
+    {
+      return Py_BuildValue("{sssssz}", "path", probe->path, "key", key,
+	  "error", strerror(probe->error));
+    }
+
+  PyObject *formats = PyDict_New();
+
+  if(!formats)
     {
       return NULL;
     }
 
-  Py_RETURN_NONE;
-}
+  int i;
 
-static PyObject *Video_device_create_buffers(Video_device *self, PyObject *args)
-{
-  int buffer_count;
+  for(i = 0; i < probe->format_count; i++)
+    {
+      struct discovered_format *format = &probe->formats[i];
+      size_t j = 0;
 
-  if(!PyArg_ParseTuple(args, "I", &buffer_count))
+      while(buffer_types[j].type != format->type)
+	{
+	  j++;
+	}
+
+      PyObject *list = PyDict_GetItemString(formats, buffer_types[j].name);
+
+      if(!list)
+	{
+	  list = PyList_New(0);
+
+	  if(!list || PyDict_SetItemString(formats, buffer_types[j].name,
+		  list))
+	    {
+	      Py_XDECREF(list);
+	      Py_DECREF(formats);
+	      return NULL;
+	    }
+
+	  Py_DECREF(list);
+	}
+
+      // Bytes, as big-endian formats set the top bit of the last character.
+
+      char fourcc[4];
+      memcpy(fourcc, &format->pixelformat, 4);
+      PyObject *item = Py_BuildValue("y#s", fourcc, (Py_ssize_t)4,
+	  format->description);
+
+      if(!item || PyList_Append(list, item))
+	{
+	  Py_XDECREF(item);
+	  Py_DECREF(formats);
+	  return NULL;
+	}
+
+      Py_DECREF(item);
+    }
+
+  struct v4l2_capability *caps = &probe->caps;
+  PyObject *capabilities = capability_set(caps->capabilities);
+  PyObject *device_capabilities = capability_set(
+      caps->capabilities & V4L2_CAP_DEVICE_CAPS ? caps->device_caps :
+      caps->capabilities);
+
+  if(!capabilities || !device_capabilities)
     {
+      Py_XDECREF(capabilities);
+      Py_XDECREF(device_capabilities);
+      Py_DECREF(formats);
       return NULL;
     }
 
-  ASSERT_OPEN;
+  return Py_BuildValue("{sssssssssssIsNsNsNsO}", "path", probe->path,
+      "key", key, "driver", (char *)caps->driver, "card", (char *)caps->card,
+      "bus_info", (char *)caps->bus_info, "version", caps->version, "capabilities",
+      capabilities, "device_capabilities", device_capabilities, "formats",
+      formats, "error", Py_None);
+}
 
-  if(self->buffers)
+static int video_node_filter(const struct dirent *entry)
+{
+  return !strncmp(entry->d_name, "video", 5);
+}
+
+static PyObject *discover(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+  double timeout = 1;
+  int max_workers = 8;
+  int use_libv4l = 0;
+  PyObject *cache = Py_None;
+  static char *kwlist [] = {
+    "timeout",
+    "max_workers",
+    "use_libv4l",
+    "cache",
+    NULL
+  };
+
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|dipO", kwlist, &timeout,
+	  &max_workers, &use_libv4l, &cache))
     {
-      PyErr_SetString(PyExc_ValueError, "Buffers are already created");
       return NULL;
     }
 
-  struct v4l2_requestbuffers reqbuf;
-  reqbuf.count = buffer_count;
-  reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  reqbuf.memory = V4L2_MEMORY_MMAP;
-
-  if(my_ioctl(self->fd, VIDIOC_REQBUFS, &reqbuf))
+  if(timeout <= 0 || max_workers < 1)
     {
+      PyErr_SetString(PyExc_ValueError, "timeout and max_workers must be "
+	  "positive");
       return NULL;
     }
 
-  if(!reqbuf.count)
+  if(cache == Py_None)
     {
-      PyErr_SetString(PyExc_IOError, "Not enough buffer memory");
-      return NULL;
+      cache = ((module_state *)PyModule_GetState(module))->discovery_cache;
     }
 
-  self->buffers = malloc(reqbuf.count * sizeof(struct buffer));
+  struct dirent **entries;
+  int entry_count = scandir("/sys/class/video4linux", &entries,
+      video_node_filter, versionsort);
 
-  if(!self->buffers)
+  if(entry_count < 0)
     {
-      PyErr_NoMemory();
+      if(errno == ENOENT)
+	{
+	  return PyList_New(0);
+	}
+
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+	  "/sys/class/video4linux");
       return NULL;
     }
 
+  // A node is identified by the physical device behind it and by the time
+  // its device file was created, which changes when the device is plugged
+  // in again or the system restarts.
+
+  PyObject *records = PyList_New(entry_count);
+  PyObject **keys = calloc(entry_count ? entry_count : 1, sizeof(PyObject *));
+  struct discovery *discovery = calloc(1, sizeof(struct discovery) +
+      entry_count * sizeof(struct probe));
   int i;
 
-  for(i = 0; i < reqbuf.count; i++)
+  if(!records || !keys || !discovery)
     {
-      struct v4l2_buffer buffer;
-      buffer.index = i;
-      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      buffer.memory = V4L2_MEMORY_MMAP;
+      Py_XDECREF(records);
+      free(keys);
+      free(discovery);
 
-      if(my_ioctl(self->fd, VIDIOC_QUERYBUF, &buffer))
+      for(i = 0; i < entry_count; i++)
 	{
-	  return NULL;
+	  free(entries[i]);
 	}
 
-      self->buffers[i].length = buffer.length;
-      self->buffers[i].start = v4l2_mmap(NULL, buffer.length,
-	  PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, buffer.m.offset);
+      free(entries);
+      return PyErr_NoMemory();
+    }
 
-      if(self->buffers[i].start == MAP_FAILED)
+  for(i = 0; i < entry_count; i++)
+    {
+      char link[300];
+      char device[PATH_MAX];
+      char key[PATH_MAX + 128];
+      struct probe *probe = &discovery->probes[discovery->probe_count];
+      struct stat status;
+      snprintf(probe->path, sizeof(probe->path), "/dev/%s",
+	  entries[i]->d_name);
+      snprintf(link, sizeof(link), "/sys/class/video4linux/%s/device",
+	  entries[i]->d_name);
+      free(entries[i]);
+
+      if(!realpath(link, device))
 	{
-	  PyErr_SetFromErrno(PyExc_IOError);
-	  return NULL;
+	  device[0] = 0;
 	}
-    }
 
-  self->buffer_count = i;
-  Py_RETURN_NONE;
-}
+      if(stat(probe->path, &status))
+	{
+	  CLEAR(status);
+	}
 
-static PyObject *Video_device_queue_all_buffers(Video_device *self)
-{
-  if(!self->buffers)
+      snprintf(key, sizeof(key), "%s %s %lld.%09ld", probe->path, device,
+	  (long long)status.st_ctim.tv_sec, (long)status.st_ctim.tv_nsec);
+      keys[i] = PyUnicode_DecodeFSDefault(key);
+      PyObject *record = keys[i] ? PyObject_GetItem(cache, keys[i]) : NULL;
+
+      if(record)
+	{
+	  PyList_SET_ITEM(records, i, record);
+	}
+      else if(keys[i] && PyErr_ExceptionMatches(PyExc_KeyError))
+	{
+	  PyErr_Clear();
+	  discovery->probe_count++;
+
+	  if(probe_is_stuck(probe->path))
+	    {
+	      probe->state = PROBE_STUCK;
+	    }
+	}
+      else
+	{
+	  break;
+	}
+    }
+
+  if(i < entry_count)
     {
-      ASSERT_OPEN;
-      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
+      for(i++; i < entry_count; i++)
+	{
+	  free(entries[i]);
+	}
+
+      free(entries);
+
+      for(i = 0; i < entry_count; i++)
+	{
+	  Py_XDECREF(keys[i]);
+	}
+
+      free(keys);
+      free(discovery);
+      Py_DECREF(records);
       return NULL;
     }
 
-  int i;
-  int buffer_count = self->buffer_count;
+  free(entries);
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&discovery->done, &attributes);
+  pthread_condattr_destroy(&attributes);
+  pthread_mutex_init(&discovery->lock, NULL);
+  discovery->references = 1;
+  discovery->use_libv4l = use_libv4l;
 
-  for(i = 0; i < buffer_count; i++)
+  Py_BEGIN_ALLOW_THREADS;
+  discovery_run(discovery, timeout, max_workers);
+  Py_END_ALLOW_THREADS;
+
+  // Probes fill the gaps between the cached records in order. Only
+  // successful probes are cached.
+
+  int failed = 0;
+  int probe_index = 0;
+
+  for(i = 0; i < entry_count; i++)
     {
-      struct v4l2_buffer buffer;
-      buffer.index = i;
-      buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      buffer.memory = V4L2_MEMORY_MMAP;
+      if(PyList_GET_ITEM(records, i))
+	{
+	  continue;
+	}
 
-      if(my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+      struct probe *probe = &discovery->probes[probe_index++];
+      PyObject *record = failed ? NULL :
+	probe_to_record(probe, PyUnicode_AsUTF8(keys[i]));
+
+      if(!record)
 	{
-	  return NULL;
+	  failed = 1;
+	  continue;
 	}
-    }
 
-  Py_RETURN_NONE;
-}
+      PyList_SET_ITEM(records, i, record);
 
-static PyObject *Video_device_read_internal(Video_device *self, int queue)
-{
-  if(!self->buffers)
-    {
-      ASSERT_OPEN;
-      PyErr_SetString(PyExc_ValueError, "Buffers have not been created");
-      return NULL;
+      if(probe->state == PROBE_DONE && !probe->error &&
+	  PyObject_SetItem(cache, keys[i], record))
+	{
+	  failed = 1;
+	}
     }
 
-  struct v4l2_buffer buffer;
-  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buffer.memory = V4L2_MEMORY_MMAP;
-
-  if(my_ioctl(self->fd, VIDIOC_DQBUF, &buffer))
+  for(i = 0; i < entry_count; i++)
     {
-      return NULL;
+      Py_DECREF(keys[i]);
     }
 
-#ifdef USE_LIBV4L
-#if PY_MAJOR_VERSION < 3
-  PyObject *result = PyString_FromStringAndSize(
-#else
-  PyObject *result = PyBytes_FromStringAndSize(
-#endif
-      self->buffers[buffer.index].start, buffer.bytesused);
+  free(keys);
+  pthread_mutex_lock(&discovery->lock);
+  discovery_release(discovery);
 
-  if(!result)
+  if(failed)
     {
+      Py_DECREF(records);
       return NULL;
     }
-#else
-  // Convert buffer from YUYV to RGB.
-  // For the byte order, see: http://v4l2spec.bytesex.org/spec/r4339.htm
-  // For the color conversion, see: http://v4l2spec.bytesex.org/spec/x2123.htm
-  int length = buffer.bytesused * 6 / 4;
-#if PY_MAJOR_VERSION < 3
-  PyObject *result = PyString_FromStringAndSize(NULL, length);
-#else
-  PyObject *result = PyBytes_FromStringAndSize(NULL, length);
-#endif
 
-  if(!result)
-    {
-      return NULL;
-    }
+  return records;
+}
 
-  char *rgb = PyString_AS_STRING(result);
-  char *rgb_max = rgb + length;
-  unsigned char *yuyv = self->buffers[buffer.index].start;
+static PyMethodDef module_methods[] = {
+  {"discover", (PyCFunction)discover,
+       METH_VARARGS|METH_KEYWORDS,
+       "discover(timeout = 1, max_workers = 8, use_libv4l = False, "
+       "cache = None) -> list\n\n"
+       "Find the video nodes listed in /sys/class/video4linux and query their "
+       "capabilities and image formats, probing up to max_workers nodes at "
+       "a time and giving up on a node after timeout seconds. Returns one "
+       "dict per node with the keys 'path', 'key', 'driver', 'card', "
+       "'bus_info', 'version', 'capabilities', 'device_capabilities', "
+       "'formats' and 'error'. 'formats' maps buffer types such as "
+       "'capture' and 'output' to lists of (fourcc, description), with fourcc "
+       "as bytes since big-endian formats set its top bit. Nodes that "
+       "couldn't be probed only have 'path', 'key' and 'error'.\n\n"
+       "Nodes are probed without libv4l unless use_libv4l is true, which "
+       "also lists the formats libv4l converts to. Successful results are "
+       "stored in cache under 'key', which changes when the device is "
+       "plugged in again. cache can be any mapping, such as a shelve, to "
+       "keep the results across restarts. By default the module keeps them "
+       "for the lifetime of the process. A node that timed out is not probed "
+       "again until the driver has returned from the earlier probe."},
+  {NULL}
+};
 
-#define CLAMP(c) ((c) <= 0 ? 0 : (c) >= 65025 ? 255 : (c) >> 8)
-  while(rgb < rgb_max)
-    {
-      int u = yuyv[1] - 128;
-      int v = yuyv[3] - 128;
-      int uv = 100 * u + 208 * v;
-      u *= 516;
-      v *= 409;
+static int module_exec(PyObject *module)
+{
+  module_state *state = PyModule_GetState(module);
 
-      int y = 298 * (yuyv[0] - 16);
-      rgb[0] = CLAMP(y + v);
-      rgb[1] = CLAMP(y - uv);
-      rgb[2] = CLAMP(y + u);
+  state->Video_device_type = (PyTypeObject *)PyType_FromModuleAndSpec(module,
+      &Video_device_spec, NULL);
+  state->M2M_device_type = (PyTypeObject *)PyType_FromModuleAndSpec(module,
+      &M2M_device_spec, NULL);
+  state->Frame_ring_type = (PyTypeObject *)PyType_FromModuleAndSpec(module,
+      &Frame_ring_spec, NULL);
+  state->Frame_synchronizer_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+      module, &Frame_synchronizer_spec, NULL);
 
-      y = 298 * (yuyv[2] - 16);
-      rgb[3] = CLAMP(y + v);
-      rgb[4] = CLAMP(y - uv);
-      rgb[5] = CLAMP(y + u);
+  if(!state->Video_device_type || !state->M2M_device_type ||
+      !state->Frame_ring_type || !state->Frame_synchronizer_type ||
+      PyModule_AddType(module, state->Video_device_type) ||
+      PyModule_AddType(module, state->M2M_device_type) ||
+      PyModule_AddType(module, state->Frame_ring_type) ||
+      PyModule_AddType(module, state->Frame_synchronizer_type))
+    {
+      return -1;
+    }
 
-      rgb += 6;
-      yuyv += 4;
+  state->discovery_cache = PyDict_New();
+
+  if(!state->discovery_cache)
+    {
+      return -1;
     }
-#undef CLAMP
-#endif
 
-  if(queue && my_ioctl(self->fd, VIDIOC_QBUF, &buffer))
+  struct constant *constant = constants;
+
+  while((void *)constant < (void *)constants + sizeof(constants))
     {
-      return NULL;
+      if(PyModule_AddIntConstant(module, constant->name, constant->value))
+	{
+	  return -1;
+	}
+
+      constant++;
     }
 
-  return result;
+  return 0;
 }
 
-static PyObject *Video_device_read(Video_device *self)
+static int module_traverse(PyObject *module, visitproc visit, void *arg)
 {
-  return Video_device_read_internal(self, 0);
+  module_state *state = PyModule_GetState(module);
+  Py_VISIT(state->Video_device_type);
+  Py_VISIT(state->M2M_device_type);
+  Py_VISIT(state->Frame_ring_type);
+  Py_VISIT(state->Frame_synchronizer_type);
+  Py_VISIT(state->discovery_cache);
+  return 0;
 }
 
-static PyObject *Video_device_read_and_queue(Video_device *self)
+static int module_clear(PyObject *module)
 {
-  return Video_device_read_internal(self, 1);
+  module_state *state = PyModule_GetState(module);
+  Py_CLEAR(state->Video_device_type);
+  Py_CLEAR(state->M2M_device_type);
+  Py_CLEAR(state->Frame_ring_type);
+  Py_CLEAR(state->Frame_synchronizer_type);
+  Py_CLEAR(state->discovery_cache);
+  return 0;
 }
 
-static PyMethodDef Video_device_methods[] = {
-  {"close", (PyCFunction)Video_device_close, METH_NOARGS,
-       "close()\n\n"
-       "Close video device. Subsequent calls to other methods will fail."},
-  {"fileno", (PyCFunction)Video_device_fileno, METH_NOARGS,
-       "fileno() -> integer \"file descriptor\".\n\n"
-       "This enables video devices to be passed select.select for waiting "
-       "until a frame is available for reading."},
-  {"get_info", (PyCFunction)Video_device_get_info, METH_NOARGS,
-       "get_info() -> driver, card, bus_info, capabilities\n\n"
-       "Returns three strings with information about the video device, and one "
-       "set containing strings identifying the capabilities of the video "
-       "device."},
-  {"get_fourcc", (PyCFunction)Video_device_get_fourcc, METH_VARARGS,
-       "get_fourcc(fourcc_string) -> fourcc_int\n\n"
-       "Return the fourcc string encoded as int."},
-  {"get_format", (PyCFunction)Video_device_get_format, METH_NOARGS,
-       "get_format() -> size_x, size_y, fourcc\n\n"
-       "Request the current video format."},
-  {"set_format", (PyCFunction)Video_device_set_format, METH_VARARGS|METH_KEYWORDS,
-       "set_format(size_x, size_y, yuv420 = 0, fourcc='MJPEG') -> size_x, size_y\n\n"
-       "Request the video device to set image size and format. The device may "
-       "choose another size than requested and will return its choice. The "
-       "image format will be RGB24 if yuv420 is zero (default) or YUV420 if "
-       "yuv420 is 1, if fourcc keyword is set that will be the fourcc pixel format used."},
-  {"set_fps", (PyCFunction)Video_device_set_fps, METH_VARARGS,
-       "set_fps(fps) -> fps \n\n"
-       "Request the video device to set frame per seconds.The device may "
-       "choose another frame rate than requested and will return its choice. " },
-  {"set_auto_white_balance", (PyCFunction)Video_device_set_auto_white_balance, METH_VARARGS,
-       "set_auto_white_balance(autowb) -> autowb \n\n"
-       "Request the video device to set auto white balance to value. The device may "
-       "choose another value than requested and will return its choice. " },
-  {"get_auto_white_balance", (PyCFunction)Video_device_get_auto_white_balance, METH_NOARGS,
-       "get_auto_white_balance() -> autowb \n\n"
-       "Request the video device to get auto white balance value. " },
-  {"set_white_balance_temperature", (PyCFunction)Video_device_set_white_balance_temperature, METH_VARARGS,
-       "set_white_balance_temperature(temp) -> temp \n\n"
-       "Request the video device to set white balance tempature to value. The device may "
-       "choose another value than requested and will return its choice. " },
-  {"get_white_balance_temperature", (PyCFunction)Video_device_get_white_balance_temperature, METH_NOARGS,
-       "get_white_balance_temperature() -> temp \n\n"
-       "Request the video device to get white balance temperature value. " },
-  {"set_exposure_auto", (PyCFunction)Video_device_set_exposure_auto, METH_VARARGS,
-       "set_exposure_auto(autoexp) -> autoexp \n\n"
-       "Request the video device to set auto exposure to value. The device may "
-       "choose another value than requested and will return its choice. " },
-  {"get_exposure_auto", (PyCFunction)Video_device_get_exposure_auto, METH_NOARGS,
-       "get_exposure_auto() -> autoexp \n\n"
-       "Request the video device to get auto exposure value. " },
-  {"set_exposure_absolute", (PyCFunction)Video_device_set_exposure_absolute, METH_VARARGS,
-       "set_exposure_absolute(exptime) -> exptime \n\n"
-       "Request the video device to set exposure time to value. The device may "
-       "choose another value than requested and will return its choice. " },
-  {"get_exposure_absolute", (PyCFunction)Video_device_get_exposure_absolute, METH_NOARGS,
-       "get_exposure_absolute() -> exptime \n\n"
-       "Request the video device to get exposure time value. " },
-  {"set_focus_auto", (PyCFunction)Video_device_set_focus_auto, METH_VARARGS,
-       "set_auto_focus_auto(autofocus) -> autofocus \n\n"
-       "Request the video device to set auto focuse on or off. The device may "
-       "choose another value than requested and will return its choice. " },
-  {"get_focus_auto", (PyCFunction)Video_device_get_focus_auto, METH_NOARGS,
-       "get_focus_auto() -> autofocus \n\n"
-       "Request the video device to get auto focus value. " },
-  {"start", (PyCFunction)Video_device_start, METH_NOARGS,
-       "start()\n\n"
-       "Start video capture."},
-  {"stop", (PyCFunction)Video_device_stop, METH_NOARGS,
-       "stop()\n\n"
-       "Stop video capture."},
-  {"create_buffers", (PyCFunction)Video_device_create_buffers, METH_VARARGS,
-       "create_buffers(count)\n\n"
-       "Create buffers used for capturing image data. Can only be called once "
-       "for each video device object."},
-  {"queue_all_buffers", (PyCFunction)Video_device_queue_all_buffers,
-       METH_NOARGS,
-       "queue_all_buffers()\n\n"
-       "Let the video device fill all buffers created."},
-  {"read", (PyCFunction)Video_device_read, METH_NOARGS,
-       "read() -> string\n\n"
-       "Reads image data from a buffer that has been filled by the video "
-       "device. The image data is in RGB och YUV420 format as decided by "
-       "'set_format'. The buffer is removed from the queue. Fails if no buffer "
-       "is filled. Use select.select to check for filled buffers."},
-  {"read_and_queue", (PyCFunction)Video_device_read_and_queue, METH_NOARGS,
-       "read_and_queue()\n\n"
-       "Same as 'read', but adds the buffer back to the queue so the video "
-       "device can fill it again."},
-  {NULL}
-};
+static void module_free(void *module)
+{
+  module_clear((PyObject *)module);
+}
 
-static PyTypeObject Video_device_type = {
-#if PY_MAJOR_VERSION < 3
-  PyObject_HEAD_INIT(NULL) 0,
-#else
-  PyVarObject_HEAD_INIT(NULL, 0)
+static PyModuleDef_Slot module_slots[] = {
+  {Py_mod_exec, module_exec},
+#ifdef Py_mod_multiple_interpreters
+  {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+  {Py_mod_gil, Py_MOD_GIL_NOT_USED},
 #endif
-      "v4l2capture.Video_device", sizeof(Video_device), 0,
-      (destructor)Video_device_dealloc, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, Py_TPFLAGS_DEFAULT, "Video_device(path)\n\nOpens the video device at "
-      "the given path and returns an object that can capture images. The "
-      "constructor and all methods except close may raise IOError.", 0, 0, 0,
-      0, 0, 0, Video_device_methods, 0, 0, 0, 0, 0, 0, 0,
-      (initproc)Video_device_init
+  {0, NULL}
 };
 
-static PyMethodDef module_methods[] = {
-  {NULL}
+static struct PyModuleDef module_def = {
+  PyModuleDef_HEAD_INIT,
+  "v4l2capture",
+  "Capture video with video4linux2.",
+  sizeof(module_state),
+  module_methods,
+  module_slots,
+  module_traverse,
+  module_clear,
+  module_free
 };
 
-#if PY_MAJOR_VERSION < 3
-PyMODINIT_FUNC initv4l2capture(void)
-#else
 PyMODINIT_FUNC PyInit_v4l2capture(void)
-#endif
 {
-  Video_device_type.tp_new = PyType_GenericNew;
-
-  if(PyType_Ready(&Video_device_type) < 0)
-    {
-#if PY_MAJOR_VERSION < 3
-      return;
-#else
-      return NULL;
-#endif
-    }
-
-  PyObject *module;
-
-#if PY_MAJOR_VERSION < 3
-  module = Py_InitModule3("v4l2capture", module_methods,
-      "Capture video with video4linux2.");
-#else
-  static struct PyModuleDef moduledef = {
-    PyModuleDef_HEAD_INIT,
-    "v4l2capture",
-    "Capture video with video4linux2.",
-    -1,
-    module_methods,
-    NULL,
-    NULL,
-    NULL,
-    NULL
-  };
-  module = PyModule_Create(&moduledef);
-#endif
-
-  if(!module)
-    {
-#if PY_MAJOR_VERSION < 3
-      return;
-#else
-      return NULL;
-#endif
-    }
-
-  Py_INCREF(&Video_device_type);
-  PyModule_AddObject(module, "Video_device", (PyObject *)&Video_device_type);
-#if PY_MAJOR_VERSION >= 3
-  return module;
-#endif
+  return PyModuleDef_Init(&module_def);
 }